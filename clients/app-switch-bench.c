@@ -0,0 +1,791 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * App-switch latency benchmark.
+ *
+ * Starts agl-compositor on headless outputs, connects a fake agl-shell client
+ * and a number of synthetic xdg-shell clients using shm buffers, and then
+ * measures how long it takes from sending agl_shell.activate_app until the
+ * compositor has processed the activation. For a target that still needs to
+ * be resized this includes the configure/ack/commit round trip which ends
+ * in ivi_layout_activate_complete(); for a target that already has the right
+ * size the activation completes within the request itself.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <wayland-client.h>
+#include <libweston-6/config-parser.h>
+
+#include "shared/helpers.h"
+#include "shared/os-compatibility.h"
+
+#include "agl-shell-client-protocol.h"
+#include "xdg-shell-client-protocol.h"
+
+#define BENCH_MAX_OUTPUTS 8
+#define BENCH_TIMEOUT_MS 2000
+
+extern char **environ;
+
+struct bench;
+
+struct bench_output {
+	struct wl_output *output;
+};
+
+struct bench_app {
+	struct bench *bench;
+	int index;
+	char app_id[32];
+
+	struct wl_display *display;
+	struct wl_registry *registry;
+	struct wl_compositor *compositor;
+	struct wl_shm *shm;
+	struct xdg_wm_base *wm_base;
+
+	struct wl_surface *surface;
+	struct xdg_surface *xdg_surface;
+	struct xdg_toplevel *toplevel;
+
+	struct wl_buffer *buffer;
+	int32_t buffer_width, buffer_height;
+
+	/* latest xdg_toplevel.configure, applied on xdg_surface.configure */
+	int32_t pending_width, pending_height;
+	bool pending_maximized;
+
+	/* what we last committed */
+	int32_t width, height;
+	bool maximized;
+
+	bool configured;
+};
+
+struct bench {
+	/* the fake shell client */
+	struct wl_display *display;
+	struct wl_registry *registry;
+	struct agl_shell *shell;
+	struct bench_output outputs[BENCH_MAX_OUTPUTS];
+	int output_count;
+
+	struct bench_app *apps;
+	int app_count;
+
+	/* usable area the apps get resized to on activation */
+	int32_t area_width, area_height;
+
+	/* app we are waiting to be resized, and the sync we are waiting on */
+	struct bench_app *waiting;
+	struct wl_callback *sync;
+
+	/* set once the step being waited for has completed */
+	bool done;
+
+	pid_t compositor_pid;
+};
+
+struct bench_sample {
+	double latency_us;
+	bool cold;
+};
+
+static uint64_t
+timespec_to_usec(const struct timespec *ts)
+{
+	return (uint64_t) ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+}
+
+static uint64_t
+now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return timespec_to_usec(&ts);
+}
+
+static void
+sync_done(void *data, struct wl_callback *callback, uint32_t unused)
+{
+	struct bench *bench = data;
+
+	/* ignore syncs left over from a switch that timed out */
+	if (callback == bench->sync) {
+		bench->sync = NULL;
+		bench->done = true;
+	}
+
+	wl_callback_destroy(callback);
+}
+
+static const struct wl_callback_listener sync_listener = {
+	sync_done,
+};
+
+static struct wl_buffer *
+create_shm_buffer(struct bench_app *app, int32_t width, int32_t height)
+{
+	struct wl_shm_pool *pool;
+	struct wl_buffer *buffer;
+	int32_t stride = width * 4;
+	int32_t size = stride * height;
+	uint32_t *data;
+	int fd;
+
+	fd = os_create_anonymous_file(size);
+	if (fd < 0) {
+		fprintf(stderr, "creating a buffer file for %d B failed: %s\n",
+			size, strerror(errno));
+		return NULL;
+	}
+
+	data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "mmap failed: %s\n", strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	/* a different opaque color per app */
+	for (int32_t i = 0; i < width * height; i++)
+		data[i] = 0xff000000 | (0x3f3f3f * (app->index + 1));
+	munmap(data, size);
+
+	pool = wl_shm_create_pool(app->shm, fd, size);
+	buffer = wl_shm_pool_create_buffer(pool, 0, width, height, stride,
+					   WL_SHM_FORMAT_XRGB8888);
+	wl_shm_pool_destroy(pool);
+	close(fd);
+
+	return buffer;
+}
+
+static void
+app_redraw(struct bench_app *app, int32_t width, int32_t height)
+{
+	struct wl_buffer *old = app->buffer;
+
+	if (!app->buffer || width != app->buffer_width ||
+	    height != app->buffer_height) {
+		app->buffer = create_shm_buffer(app, width, height);
+		app->buffer_width = width;
+		app->buffer_height = height;
+	}
+
+	wl_surface_attach(app->surface, app->buffer, 0, 0);
+	wl_surface_damage(app->surface, 0, 0, width, height);
+	wl_surface_commit(app->surface);
+
+	if (old && old != app->buffer)
+		wl_buffer_destroy(old);
+
+	app->width = width;
+	app->height = height;
+}
+
+static bool
+app_has_size(struct bench_app *app, int32_t width, int32_t height)
+{
+	return app->maximized && app->width == width && app->height == height;
+}
+
+static void
+xdg_wm_base_ping(void *data, struct xdg_wm_base *wm_base, uint32_t serial)
+{
+	xdg_wm_base_pong(wm_base, serial);
+}
+
+static const struct xdg_wm_base_listener wm_base_listener = {
+	xdg_wm_base_ping,
+};
+
+static void
+xdg_surface_configure(void *data, struct xdg_surface *xdg_surface,
+		      uint32_t serial)
+{
+	struct bench_app *app = data;
+	int32_t width = app->pending_width;
+	int32_t height = app->pending_height;
+
+	xdg_surface_ack_configure(xdg_surface, serial);
+
+	/* the compositor left the size up to us */
+	if (width == 0 || height == 0) {
+		width = 320;
+		height = 240;
+	}
+
+	app->maximized = app->pending_maximized;
+	app_redraw(app, width, height);
+	app->configured = true;
+
+	if (app->bench->waiting == app &&
+	    app_has_size(app, app->bench->area_width, app->bench->area_height))
+		app->bench->done = true;
+}
+
+static const struct xdg_surface_listener xdg_surface_listener = {
+	xdg_surface_configure,
+};
+
+static void
+xdg_toplevel_configure(void *data, struct xdg_toplevel *toplevel,
+		       int32_t width, int32_t height, struct wl_array *states)
+{
+	struct bench_app *app = data;
+	uint32_t *state;
+
+	app->pending_width = width;
+	app->pending_height = height;
+	app->pending_maximized = false;
+
+	wl_array_for_each(state, states)
+		if (*state == XDG_TOPLEVEL_STATE_MAXIMIZED)
+			app->pending_maximized = true;
+}
+
+static void
+xdg_toplevel_close(void *data, struct xdg_toplevel *toplevel)
+{
+}
+
+static const struct xdg_toplevel_listener xdg_toplevel_listener = {
+	xdg_toplevel_configure,
+	xdg_toplevel_close,
+};
+
+static void
+app_registry_global(void *data, struct wl_registry *registry, uint32_t name,
+		    const char *interface, uint32_t version)
+{
+	struct bench_app *app = data;
+
+	if (strcmp(interface, "wl_compositor") == 0) {
+		app->compositor = wl_registry_bind(registry, name,
+						   &wl_compositor_interface, 1);
+	} else if (strcmp(interface, "wl_shm") == 0) {
+		app->shm = wl_registry_bind(registry, name,
+					    &wl_shm_interface, 1);
+	} else if (strcmp(interface, "xdg_wm_base") == 0) {
+		app->wm_base = wl_registry_bind(registry, name,
+						&xdg_wm_base_interface, 1);
+		xdg_wm_base_add_listener(app->wm_base, &wm_base_listener, app);
+	}
+}
+
+static void
+registry_global_remove(void *data, struct wl_registry *registry,
+		       uint32_t name)
+{
+}
+
+static const struct wl_registry_listener app_registry_listener = {
+	app_registry_global,
+	registry_global_remove,
+};
+
+static int
+app_create(struct bench *bench, struct bench_app *app, const char *socket,
+	   int index)
+{
+	app->bench = bench;
+	app->index = index;
+	snprintf(app->app_id, sizeof app->app_id, "bench-app-%d", index);
+
+	app->display = wl_display_connect(socket);
+	if (!app->display)
+		return -1;
+
+	app->registry = wl_display_get_registry(app->display);
+	wl_registry_add_listener(app->registry, &app_registry_listener, app);
+	wl_display_roundtrip(app->display);
+
+	if (!app->compositor || !app->shm || !app->wm_base) {
+		fprintf(stderr, "%s: missing globals\n", app->app_id);
+		return -1;
+	}
+
+	app->surface = wl_compositor_create_surface(app->compositor);
+	app->xdg_surface = xdg_wm_base_get_xdg_surface(app->wm_base,
+						       app->surface);
+	xdg_surface_add_listener(app->xdg_surface, &xdg_surface_listener, app);
+	app->toplevel = xdg_surface_get_toplevel(app->xdg_surface);
+	xdg_toplevel_add_listener(app->toplevel, &xdg_toplevel_listener, app);
+	xdg_toplevel_set_app_id(app->toplevel, app->app_id);
+	wl_surface_commit(app->surface);
+
+	while (!app->configured)
+		if (wl_display_dispatch(app->display) < 0)
+			return -1;
+
+	/* make sure the compositor has seen our first buffer */
+	wl_display_roundtrip(app->display);
+
+	return 0;
+}
+
+static void
+app_destroy(struct bench_app *app)
+{
+	if (!app->display)
+		return;
+
+	if (app->buffer)
+		wl_buffer_destroy(app->buffer);
+	if (app->toplevel)
+		xdg_toplevel_destroy(app->toplevel);
+	if (app->xdg_surface)
+		xdg_surface_destroy(app->xdg_surface);
+	if (app->surface)
+		wl_surface_destroy(app->surface);
+	if (app->wm_base)
+		xdg_wm_base_destroy(app->wm_base);
+	if (app->shm)
+		wl_shm_destroy(app->shm);
+	if (app->compositor)
+		wl_compositor_destroy(app->compositor);
+	wl_registry_destroy(app->registry);
+	wl_display_disconnect(app->display);
+}
+
+static void
+shell_registry_global(void *data, struct wl_registry *registry, uint32_t name,
+		      const char *interface, uint32_t version)
+{
+	struct bench *bench = data;
+
+	if (strcmp(interface, "agl_shell") == 0) {
+		bench->shell = wl_registry_bind(registry, name,
+						&agl_shell_interface, 1);
+	} else if (strcmp(interface, "wl_output") == 0) {
+		if (bench->output_count >= BENCH_MAX_OUTPUTS)
+			return;
+
+		bench->outputs[bench->output_count++].output =
+			wl_registry_bind(registry, name,
+					 &wl_output_interface, 1);
+	}
+}
+
+static const struct wl_registry_listener shell_registry_listener = {
+	shell_registry_global,
+	registry_global_remove,
+};
+
+/*
+ * Dispatch the shell client and all app clients until the switch in
+ * progress is done, or the timeout expires.
+ */
+static int
+bench_wait(struct bench *bench, uint64_t deadline_us)
+{
+	int count = bench->app_count + 1;
+	struct wl_display *displays[count];
+	struct pollfd fds[count];
+
+	displays[0] = bench->display;
+	for (int i = 0; i < bench->app_count; i++)
+		displays[i + 1] = bench->apps[i].display;
+
+	while (!bench->done) {
+		uint64_t now = now_usec();
+		int ret;
+
+		if (now >= deadline_us)
+			return -1;
+
+		for (int i = 0; i < count; i++) {
+			while (wl_display_prepare_read(displays[i]) != 0)
+				wl_display_dispatch_pending(displays[i]);
+			wl_display_flush(displays[i]);
+
+			fds[i].fd = wl_display_get_fd(displays[i]);
+			fds[i].events = POLLIN;
+			fds[i].revents = 0;
+		}
+
+		ret = poll(fds, count, (deadline_us - now) / 1000 + 1);
+
+		for (int i = 0; i < count; i++) {
+			if (ret > 0 && (fds[i].revents & POLLIN))
+				wl_display_read_events(displays[i]);
+			else
+				wl_display_cancel_read(displays[i]);
+
+			if (wl_display_dispatch_pending(displays[i]) < 0)
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Runs a single activation and returns its latency in microseconds, or a
+ * negative value on timeout.
+ */
+static double
+bench_switch(struct bench *bench, struct bench_app *app,
+	     struct bench_output *output, bool *cold)
+{
+	struct wl_display *sync_display = bench->display;
+	uint64_t start, deadline;
+
+	*cold = !app_has_size(app, bench->area_width, bench->area_height);
+	bench->done = false;
+
+	start = now_usec();
+	deadline = start + BENCH_TIMEOUT_MS * 1000;
+
+	agl_shell_activate_app(bench->shell, app->app_id, output->output);
+
+	if (*cold) {
+		/*
+		 * The compositor first needs to tell the app to resize; the
+		 * activation completes once it has processed the commit with
+		 * the new size.
+		 */
+		bench->waiting = app;
+		if (bench_wait(bench, deadline) < 0) {
+			bench->waiting = NULL;
+			return -1;
+		}
+
+		bench->waiting = NULL;
+		bench->done = false;
+		sync_display = app->display;
+	}
+
+	bench->sync = wl_display_sync(sync_display);
+	wl_callback_add_listener(bench->sync, &sync_listener, bench);
+	if (bench_wait(bench, deadline) < 0) {
+		bench->sync = NULL;
+		return -1;
+	}
+
+	return (double) (now_usec() - start);
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+static void
+print_stats(const char *name, const struct bench_sample *samples, int count,
+	    int cold)
+{
+	double *values;
+	int n = 0;
+
+	values = calloc(count > 0 ? count : 1, sizeof *values);
+	if (!values)
+		return;
+
+	for (int i = 0; i < count; i++)
+		if (cold < 0 || samples[i].cold == cold)
+			values[n++] = samples[i].latency_us;
+
+	if (n == 0) {
+		printf("%-8s %6d\n", name, 0);
+		free(values);
+		return;
+	}
+
+	qsort(values, n, sizeof values[0], compare_double);
+
+	printf("%-8s %6d %10.1f %10.1f %10.1f\n", name, n,
+	       values[(n - 1) / 2], values[(n - 1) * 99 / 100], values[n - 1]);
+	free(values);
+}
+
+/* user + system CPU time of the compositor, in microseconds */
+static int64_t
+compositor_cpu_usec(pid_t pid)
+{
+	unsigned long utime, stime;
+	char path[64];
+	char buf[1024];
+	char *p;
+	FILE *f;
+	size_t len;
+
+	snprintf(path, sizeof path, "/proc/%d/stat", pid);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	len = fread(buf, 1, sizeof buf - 1, f);
+	fclose(f);
+	buf[len] = '\0';
+
+	/* skip over pid and (comm), which may contain spaces */
+	p = strrchr(buf, ')');
+	if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+			 "%lu %lu", &utime, &stime) != 2)
+		return -1;
+
+	return (int64_t) (utime + stime) * 1000000 / sysconf(_SC_CLK_TCK);
+}
+
+static pid_t
+spawn_compositor(const char *path, const char *socket, int width, int height,
+		 int output_count, const char *log)
+{
+	char socket_arg[64], width_arg[32], height_arg[32], count_arg[32];
+	char log_arg[256];
+	char *argv[] = {
+		(char *) path,
+		"--backend=headless-backend.so",
+		"--use-pixman",
+		"--no-config",
+		socket_arg,
+		width_arg,
+		height_arg,
+		count_arg,
+		log ? log_arg : NULL,
+		NULL,
+	};
+	pid_t pid;
+	int ret;
+
+	snprintf(socket_arg, sizeof socket_arg, "--socket=%s", socket);
+	snprintf(width_arg, sizeof width_arg, "--width=%d", width);
+	snprintf(height_arg, sizeof height_arg, "--height=%d", height);
+	snprintf(count_arg, sizeof count_arg, "--output-count=%d", output_count);
+	if (log)
+		snprintf(log_arg, sizeof log_arg, "--log=%s", log);
+
+	ret = posix_spawnp(&pid, path, NULL, NULL, argv, environ);
+	if (ret != 0) {
+		fprintf(stderr, "failed to start '%s': %s\n", path,
+			strerror(ret));
+		return -1;
+	}
+
+	return pid;
+}
+
+static struct wl_display *
+connect_to_compositor(const char *socket, pid_t pid)
+{
+	struct wl_display *display;
+
+	for (int i = 0; i < 500; i++) {
+		display = wl_display_connect(socket);
+		if (display)
+			return display;
+
+		if (waitpid(pid, NULL, WNOHANG) == pid) {
+			fprintf(stderr, "compositor exited during start-up\n");
+			return NULL;
+		}
+
+		usleep(10 * 1000);
+	}
+
+	fprintf(stderr, "timed out connecting to '%s'\n", socket);
+	return NULL;
+}
+
+static void
+usage(int error_code)
+{
+	FILE *out = error_code == EXIT_SUCCESS ? stdout : stderr;
+
+	fprintf(out,
+		"Usage: agl-compositor-bench [OPTIONS]\n"
+		"\n"
+		"Measures app switch latency of agl-compositor on headless outputs.\n"
+		"\n"
+		"  --compositor=PATH\tCompositor to start, defaults to agl-compositor\n"
+		"  --apps=N\t\tNumber of synthetic apps, defaults to 4\n"
+		"  --switches=N\t\tNumber of activations to measure, defaults to 200\n"
+		"  --width=WIDTH\t\tOutput width, defaults to 1920\n"
+		"  --height=HEIGHT\tOutput height, defaults to 1080\n"
+		"  --output-count=COUNT\tNumber of outputs, defaults to 1\n"
+		"  --log=FILE\t\tLog file for the compositor\n"
+		"  -h, --help\t\tThis help message\n"
+		"\n");
+	exit(error_code);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench bench = { 0 };
+	struct bench_sample *samples = NULL;
+	char *compositor = NULL;
+	char *log = NULL;
+	char socket[64];
+	int app_count = 4;
+	int switches = 200;
+	int width = 1920;
+	int height = 1080;
+	int output_count = 1;
+	int help = 0;
+	int failed = 0;
+	int ret = EXIT_FAILURE;
+	int64_t cpu_start, cpu_end;
+
+	const struct weston_option options[] = {
+		{ WESTON_OPTION_STRING, "compositor", 0, &compositor },
+		{ WESTON_OPTION_INTEGER, "apps", 0, &app_count },
+		{ WESTON_OPTION_INTEGER, "switches", 0, &switches },
+		{ WESTON_OPTION_INTEGER, "width", 0, &width },
+		{ WESTON_OPTION_INTEGER, "height", 0, &height },
+		{ WESTON_OPTION_INTEGER, "output-count", 0, &output_count },
+		{ WESTON_OPTION_STRING, "log", 0, &log },
+		{ WESTON_OPTION_BOOLEAN, "help", 'h', &help },
+	};
+
+	parse_options(options, ARRAY_LENGTH(options), &argc, argv);
+	if (help)
+		usage(EXIT_SUCCESS);
+	if (argc > 1 || app_count < 1 || switches < 1 || width < 1 ||
+	    height < 1 || output_count < 1 ||
+	    output_count > BENCH_MAX_OUTPUTS)
+		usage(EXIT_FAILURE);
+
+	if (!getenv("XDG_RUNTIME_DIR")) {
+		fprintf(stderr, "XDG_RUNTIME_DIR is not set\n");
+		return EXIT_FAILURE;
+	}
+
+	snprintf(socket, sizeof socket, "agl-bench-%d", getpid());
+	bench.compositor_pid = spawn_compositor(compositor ? compositor :
+						"agl-compositor", socket,
+						width, height, output_count,
+						log);
+	if (bench.compositor_pid < 0)
+		return EXIT_FAILURE;
+
+	bench.display = connect_to_compositor(socket, bench.compositor_pid);
+	if (!bench.display)
+		goto out;
+
+	bench.registry = wl_display_get_registry(bench.display);
+	wl_registry_add_listener(bench.registry, &shell_registry_listener,
+				 &bench);
+	wl_display_roundtrip(bench.display);
+
+	if (!bench.shell || bench.output_count == 0) {
+		fprintf(stderr, "agl_shell or wl_output not advertised\n");
+		goto out;
+	}
+
+	agl_shell_ready(bench.shell);
+	wl_display_roundtrip(bench.display);
+
+	/*
+	 * We don't set up any panels, so the usable area is the whole output,
+	 * and all headless outputs have the same size.
+	 */
+	bench.area_width = width;
+	bench.area_height = height;
+
+	bench.apps = calloc(app_count, sizeof *bench.apps);
+	samples = calloc(switches, sizeof *samples);
+	if (!bench.apps || !samples)
+		goto out;
+
+	for (int i = 0; i < app_count; i++) {
+		if (app_create(&bench, &bench.apps[i], socket, i) < 0) {
+			fprintf(stderr, "failed to create app %d\n", i);
+			goto out;
+		}
+		bench.app_count++;
+	}
+
+	cpu_start = compositor_cpu_usec(bench.compositor_pid);
+
+	for (int i = 0; i < switches; i++) {
+		struct bench_app *app = &bench.apps[i % app_count];
+		struct bench_output *output =
+			&bench.outputs[i % bench.output_count];
+		double latency;
+		bool cold;
+
+		latency = bench_switch(&bench, app, output, &cold);
+		if (latency < 0) {
+			failed++;
+			continue;
+		}
+
+		samples[i - failed].latency_us = latency;
+		samples[i - failed].cold = cold;
+	}
+
+	cpu_end = compositor_cpu_usec(bench.compositor_pid);
+
+	printf("%d apps, %d outputs of %dx%d, %d switches, %d timed out\n",
+	       app_count, bench.output_count, width, height, switches, failed);
+	printf("%-8s %6s %10s %10s %10s\n",
+	       "latency", "count", "p50 (us)", "p99 (us)", "max (us)");
+	print_stats("all", samples, switches - failed, -1);
+	print_stats("cold", samples, switches - failed, 1);
+	print_stats("warm", samples, switches - failed, 0);
+
+	if (cpu_start >= 0 && cpu_end >= 0)
+		printf("compositor CPU per switch: %.1f us\n",
+		       (double) (cpu_end - cpu_start) / switches);
+
+	ret = failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+out:
+	for (int i = 0; i < bench.app_count; i++)
+		app_destroy(&bench.apps[i]);
+	if (bench.display)
+		wl_display_disconnect(bench.display);
+
+	kill(bench.compositor_pid, SIGTERM);
+	waitpid(bench.compositor_pid, NULL, 0);
+
+	free(bench.apps);
+	free(samples);
+	free(compositor);
+	free(log);
+
+	return ret;
+}
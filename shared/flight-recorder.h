@@ -0,0 +1,84 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef FLIGHT_RECORDER_H
+#define FLIGHT_RECORDER_H
+
+#include <stdint.h>
+
+/*
+ * On-disk format of the flight recorder dumps, shared by the compositor and
+ * the decoder. A dump is a header followed by 'capacity' records, in host
+ * byte order. Records are written in a circular fashion: 'next' is the
+ * number of records ever written, the oldest one is at 'next % capacity' once
+ * the ring wrapped around.
+ */
+
+#define FLIGHT_RECORDER_MAGIC "AGLFREC"
+#define FLIGHT_RECORDER_VERSION 1
+#define FLIGHT_RECORDER_CAPACITY 4096
+
+struct flight_recorder_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t capacity;
+	uint32_t pad;
+	uint64_t next;
+};
+
+enum flight_recorder_event {
+	/* a: output id, b: app_id, truncated to 8 bytes */
+	FLIGHT_RECORDER_ACTIVATE = 1,
+	FLIGHT_RECORDER_ACTIVATE_DONE,
+	/* a: enum ivi_surface_role, b: surface */
+	FLIGHT_RECORDER_COMMIT,
+	/* a: layer position, b: view */
+	FLIGHT_RECORDER_LAYER_INSERT,
+	FLIGHT_RECORDER_LAYER_REMOVE,
+	/* a: output id, b: 0 */
+	FLIGHT_RECORDER_OUTPUT_ADDED,
+	FLIGHT_RECORDER_OUTPUT_REMOVED,
+	/* a: pid, b: client */
+	FLIGHT_RECORDER_CLIENT_CREATED,
+	FLIGHT_RECORDER_CLIENT_DESTROYED,
+	/* a: output id, b: pixels damaged */
+	FLIGHT_RECORDER_REPAINT,
+	/* a: 0, b: 0 */
+	FLIGHT_RECORDER_SHELL_READY,
+	/* a: signal number, b: fault address */
+	FLIGHT_RECORDER_SIGNAL,
+	/* a: 0, b: 0 */
+	FLIGHT_RECORDER_EXIT,
+};
+
+struct flight_recorder_record {
+	uint64_t time;		/* CLOCK_MONOTONIC, in nanoseconds */
+	uint32_t type;		/* enum flight_recorder_event */
+	uint32_t a;
+	uint64_t b;
+};
+
+#endif
@@ -0,0 +1,96 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Layout of the metrics page the compositor keeps up to date, see
+ * src/metrics.c. Readers mmap() the file read-only and copy it out with
+ * metrics_read(), which retries while the compositor is in the middle of an
+ * update: 'seq' is odd during an update, and changes with every update.
+ *
+ * Fields are in host byte order. New fields only get added at the end, with
+ * 'size' growing accordingly; anything else bumps the version.
+ */
+
+#define METRICS_MAGIC "AGLMETR"
+#define METRICS_VERSION 1
+#define METRICS_MAX_OUTPUTS 8
+
+struct metrics_output {
+	char name[32];		/* empty if the slot is unused */
+	char active_app_id[64];	/* truncated, empty if none */
+	uint32_t id;		/* weston_output id */
+	uint32_t enabled;
+	uint64_t frames;	/* repaints */
+	/* repaints that took longer than the repaint window */
+	uint64_t missed_frames;
+	/* from the time the repaint was due until it got submitted */
+	uint64_t repaint_usec_last;
+	uint64_t repaint_usec_max;
+	uint64_t repaint_usec_total;
+};
+
+struct metrics_page {
+	char magic[8];
+	uint32_t version;
+	uint32_t size;		/* sizeof(struct metrics_page) */
+	uint32_t seq;
+	uint32_t clients;	/* not counting the compositor's own */
+	uint64_t update_time;	/* CLOCK_MONOTONIC, in nanoseconds */
+	/* indexed by enum ivi_surface_role: none, desktop, background, panel */
+	uint32_t surfaces[4];
+	uint32_t repaint_window_msec;
+	uint32_t pad;
+	struct metrics_output outputs[METRICS_MAX_OUTPUTS];
+};
+
+/* Returns 0 with a consistent copy in 'copy', -1 if the page is not valid */
+static inline int
+metrics_read(const struct metrics_page *page, struct metrics_page *copy)
+{
+	uint32_t seq;
+
+	if (memcmp(page->magic, METRICS_MAGIC, sizeof(page->magic)) ||
+	    page->version != METRICS_VERSION || page->size < sizeof(*copy))
+		return -1;
+
+	do {
+		do {
+			seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+		} while (seq & 1);
+
+		memcpy(copy, page, sizeof(*copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) != seq);
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,57 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef SPLASH_H
+#define SPLASH_H
+
+#include <stdint.h>
+
+/*
+ * Raw splash images, as taken by the compositor for 'splash' in [output] and
+ * written by agl-compositor-splash-convert from PNG files. Such a file is
+ * the header below followed by 'height' rows of 'stride' bytes each, all in
+ * host byte order, so it has to be made on a machine with the same byte
+ * order as the target.
+ *
+ * Pixels are 32-bit values in the given wl_shm format, that is 0xAARRGGBB
+ * with premultiplied alpha for ARGB8888, and the alpha byte ignored for
+ * XRGB8888.
+ */
+
+#define SPLASH_MAGIC "AGLSPLSH"
+
+/* same values as enum wl_shm_format */
+#define SPLASH_FORMAT_ARGB8888 0
+#define SPLASH_FORMAT_XRGB8888 1
+
+struct splash_header {
+	char magic[8];		/* SPLASH_MAGIC, without the terminating NUL */
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;	/* at least width * 4 */
+	uint32_t format;	/* SPLASH_FORMAT_* */
+};
+
+#endif
@@ -0,0 +1,218 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Debug scopes
+ *
+ * Debug messages go through ivi_debug(), which only costs a test of
+ * ivi->debug_scopes when the scope is disabled. Enabled messages are kept in
+ * an in-memory ring of the last IVI_DEBUG_RING_LINES lines rather than
+ * written to the log, and are dumped into the log on demand.
+ *
+ * The scopes enabled at start-up are given with debug-scopes in [core], a
+ * comma separated list of layout, shell, desktop, output or all. SIGUSR2
+ * toggles them at runtime: disabling dumps what was recorded so far into the
+ * log, enabling brings back the configured scopes, or all of them if none
+ * were configured.
+ */
+
+#include "ivi-compositor.h"
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libweston-6/config-parser.h>
+
+#include "shared/helpers.h"
+
+#define IVI_DEBUG_RING_LINES	1024
+#define IVI_DEBUG_LINE_SIZE	160
+
+struct ivi_debug_line {
+	struct timespec ts;
+	uint32_t scope;
+	char text[IVI_DEBUG_LINE_SIZE];
+};
+
+struct ivi_debug {
+	uint32_t configured;
+	uint64_t count;		/* lines ever recorded */
+	struct ivi_debug_line lines[IVI_DEBUG_RING_LINES];
+};
+
+static const struct {
+	const char *name;
+	uint32_t scope;
+} ivi_debug_scope_names[] = {
+	{ "layout", IVI_DEBUG_LAYOUT },
+	{ "shell", IVI_DEBUG_SHELL },
+	{ "desktop", IVI_DEBUG_DESKTOP },
+	{ "output", IVI_DEBUG_OUTPUT },
+};
+
+static const char *
+ivi_debug_scope_name(uint32_t scope)
+{
+	for (size_t i = 0; i < ARRAY_LENGTH(ivi_debug_scope_names); i++)
+		if (ivi_debug_scope_names[i].scope == scope)
+			return ivi_debug_scope_names[i].name;
+
+	return "?";
+}
+
+static uint32_t
+ivi_debug_parse_scopes(const char *str)
+{
+	uint32_t scopes = 0;
+	char *copy, *name, *saveptr;
+
+	copy = strdup(str);
+	if (!copy)
+		return 0;
+
+	for (name = strtok_r(copy, ", ", &saveptr); name;
+	     name = strtok_r(NULL, ", ", &saveptr)) {
+		size_t i;
+
+		if (strcmp(name, "all") == 0) {
+			scopes |= IVI_DEBUG_ALL;
+			continue;
+		}
+
+		for (i = 0; i < ARRAY_LENGTH(ivi_debug_scope_names); i++) {
+			if (strcmp(name, ivi_debug_scope_names[i].name) == 0) {
+				scopes |= ivi_debug_scope_names[i].scope;
+				break;
+			}
+		}
+
+		if (i == ARRAY_LENGTH(ivi_debug_scope_names))
+			weston_log("Unknown debug scope '%s'\n", name);
+	}
+
+	free(copy);
+
+	return scopes;
+}
+
+int
+ivi_debug_init(struct ivi_compositor *ivi)
+{
+	struct weston_config_section *section;
+	char *scopes;
+
+	ivi->debug = zalloc(sizeof(*ivi->debug));
+	if (!ivi->debug)
+		return -1;
+
+	section = weston_config_get_section(ivi->config, "core", NULL, NULL);
+	weston_config_section_get_string(section, "debug-scopes", &scopes, NULL);
+	if (scopes) {
+		ivi->debug->configured = ivi_debug_parse_scopes(scopes);
+		free(scopes);
+	}
+
+	ivi->debug_scopes = ivi->debug->configured;
+
+	return 0;
+}
+
+void
+ivi_debug_destroy(struct ivi_compositor *ivi)
+{
+	free(ivi->debug);
+	ivi->debug = NULL;
+	ivi->debug_scopes = 0;
+}
+
+void
+ivi_debug_log(struct ivi_compositor *ivi, uint32_t scope, const char *fmt, ...)
+{
+	struct ivi_debug_line *line;
+	va_list ap;
+
+	if (!ivi->debug)
+		return;
+
+	line = &ivi->debug->lines[ivi->debug->count++ % IVI_DEBUG_RING_LINES];
+	line->scope = scope;
+	clock_gettime(CLOCK_MONOTONIC, &line->ts);
+
+	va_start(ap, fmt);
+	vsnprintf(line->text, sizeof line->text, fmt, ap);
+	va_end(ap);
+}
+
+/* Writes the recorded lines into the log, oldest first */
+void
+ivi_debug_dump(struct ivi_compositor *ivi)
+{
+	struct ivi_debug *debug = ivi->debug;
+	uint64_t first;
+
+	if (!debug)
+		return;
+
+	first = debug->count > IVI_DEBUG_RING_LINES ?
+		debug->count - IVI_DEBUG_RING_LINES : 0;
+
+	weston_log("Debug ring: %" PRIu64 " lines, %" PRIu64 " overwritten\n",
+		   debug->count - first, first);
+
+	for (uint64_t i = first; i < debug->count; i++) {
+		struct ivi_debug_line *line =
+			&debug->lines[i % IVI_DEBUG_RING_LINES];
+		size_t len = strlen(line->text);
+
+		weston_log_continue("[%ld.%06ld] %s: %s%s",
+				    (long) line->ts.tv_sec,
+				    line->ts.tv_nsec / 1000,
+				    ivi_debug_scope_name(line->scope),
+				    line->text,
+				    len && line->text[len - 1] == '\n' ?
+				    "" : "\n");
+	}
+}
+
+void
+ivi_debug_toggle(struct ivi_compositor *ivi)
+{
+	if (!ivi->debug)
+		return;
+
+	if (ivi->debug_scopes) {
+		ivi_debug_dump(ivi);
+		ivi->debug_scopes = 0;
+		weston_log("Debug scopes disabled\n");
+	} else {
+		ivi->debug_scopes = ivi->debug->configured ?
+				    ivi->debug->configured : IVI_DEBUG_ALL;
+		weston_log("Debug scopes 0x%x enabled\n", ivi->debug_scopes);
+	}
+}
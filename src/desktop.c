@@ -24,6 +24,7 @@
  */
 
 #include "ivi-compositor.h"
+#include "shared/flight-recorder.h"
 
 #include <libweston-6/compositor.h>
 #include <libweston-6/libweston-desktop.h>
@@ -79,8 +80,16 @@ desktop_surface_added(struct weston_desktop_surface *dsurface, void *userdata)
 	surface->ivi = ivi;
 	surface->dsurface = dsurface;
 	surface->role = IVI_SURFACE_ROLE_NONE;
+	wl_list_init(&surface->app_link);
+	wl_list_init(&surface->handle_link);
+	wl_list_init(&surface->window_list.link);
+	surface->handle = ++ivi->last_handle;
+	wl_list_init(&surface->standby_link);
+	surface->hidden.fps = ivi->hidden_fps;
+	ivi_metrics_surface_added(ivi, surface->role);
 
 	weston_desktop_surface_set_user_data(dsurface, surface);
+	ivi_debug(ivi, IVI_DEBUG_DESKTOP, "surface %p added\n", surface);
 
 	if (ivi->shell_client.ready) {
 		ivi_set_desktop_surface(surface);
@@ -94,6 +103,25 @@ desktop_surface_added(struct weston_desktop_surface *dsurface, void *userdata)
 	}
 }
 
+/* Backgrounds and panels can go away while the shell client is still bound */
+static void
+ivi_output_forget_surface(struct ivi_output *output,
+			  struct ivi_surface *surface)
+{
+	struct ivi_surface **members[] = {
+		&output->background,
+		&output->top, &output->bottom,
+		&output->left, &output->right,
+	};
+
+	for (size_t i = 0; i < ARRAY_LENGTH(members); i++)
+		if (*members[i] == surface)
+			*members[i] = NULL;
+
+	if (!output->background)
+		output->background_occluded = false;
+}
+
 static void
 desktop_surface_removed(struct weston_desktop_surface *dsurface, void *userdata)
 {
@@ -102,49 +130,144 @@ desktop_surface_removed(struct weston_desktop_surface *dsurface, void *userdata)
 	struct weston_surface *wsurface =
 		weston_desktop_surface_get_surface(dsurface);
 
-	struct ivi_output *output = surface->desktop.last_output;
+	struct ivi_output *output = NULL;
 
-	/* TODO */
-	if (surface->role != IVI_SURFACE_ROLE_DESKTOP)
-		return;
+	ivi_debug(surface->ivi, IVI_DEBUG_DESKTOP, "surface %p (%s) removed\n",
+		  surface, surface->app_id ? surface->app_id : "no app_id");
+
+	ivi_metrics_surface_removed(surface->ivi, surface->role);
+	ivi_layout_transaction_surface_removed(surface);
+
+	if (surface->role == IVI_SURFACE_ROLE_BACKGROUND)
+		ivi_output_forget_surface(surface->bg.output, surface);
+	else if (surface->role == IVI_SURFACE_ROLE_PANEL)
+		ivi_output_forget_surface(surface->panel.output, surface);
+	else if (surface->role == IVI_SURFACE_ROLE_DESKTOP)
+		output = surface->desktop.last_output;
+
+	/* a standby app has last_output set too, but it is not the active one */
+	ivi_layout_standby_remove(surface);
 
-	/* reset the active surface as well */
-	if (output && output->active) {
+	/* reset the active surface as well, if it's this one */
+	if (output && output->active == surface) {
 		output->active->view->is_mapped = false;
 		output->active->view->surface->is_mapped = false;
 
-		weston_layer_entry_remove(&output->active->view->layer_link);
+		ivi_layer_remove(output->active->view);
 		output->active = NULL;
+
+		ivi_layout_update_occlusion(output);
 	}
 	if (weston_surface_is_mapped(wsurface)) {
 		weston_desktop_surface_unlink_view(surface->view);
 		weston_view_destroy(surface->view);
 	}
 
+	ivi_layout_hidden_reset(surface);
+	ivi_layout_remove_app_id(surface);
 	wl_list_remove(&surface->link);
 	free(surface);
 }
 
+static bool
+ivi_surface_is_visible(struct ivi_surface *surface)
+{
+	struct weston_layer *layer = surface->view->layer_link.layer;
+
+	if (!layer || layer == &surface->ivi->hidden)
+		return false;
+
+	if (surface->role == IVI_SURFACE_ROLE_BACKGROUND &&
+	    surface->bg.output->background_occluded)
+		return false;
+
+	return true;
+}
+
+/*
+ * Only the outputs the view is on need to repaint, and none at all if it
+ * can't be seen. That is on top of libweston, which schedules a repaint of
+ * the outputs in the output_mask of the surface on every commit whatever
+ * we do, so that views on the hidden layer get their frame events. Those
+ * count as scheduled, only the other outputs as avoided.
+ */
+static void
+ivi_surface_schedule_repaint(struct ivi_surface *surface)
+{
+	struct weston_view *view = surface->view;
+	uint32_t surface_mask = view->surface->output_mask;
+	bool visible = ivi_surface_is_visible(surface);
+	struct ivi_output *output;
+
+	wl_list_for_each(output, &surface->ivi->outputs, link) {
+		struct weston_output *woutput = output->output;
+		uint32_t bit;
+
+		if (!woutput || !woutput->enabled)
+			continue;
+
+		bit = 1u << woutput->id;
+		if (visible && (view->output_mask & bit)) {
+			weston_output_schedule_repaint(woutput);
+			output->commit_repaint.scheduled++;
+		} else if (surface_mask & bit) {
+			output->commit_repaint.scheduled++;
+		} else {
+			output->commit_repaint.avoided++;
+		}
+	}
+}
+
 static void
 desktop_committed(struct weston_desktop_surface *dsurface, 
 		  int32_t sx, int32_t sy, void *userdata)
 {
 	struct ivi_surface *surface =
 		weston_desktop_surface_get_user_data(dsurface);
-	weston_compositor_schedule_repaint(surface->ivi->compositor);
+	struct ivi_output *output;
+
+	ivi_flight_record(FLIGHT_RECORDER_COMMIT, surface->role,
+			  (uintptr_t) surface);
+
+	if (surface->role == IVI_SURFACE_ROLE_DESKTOP)
+		ivi_layout_update_app_id(surface);
+
+	/* shown along with the rest of the transaction */
+	if (ivi_layout_transaction_surface_committed(surface)) {
+		ivi_surface_schedule_repaint(surface);
+		return;
+	}
 
 	switch (surface->role) {
 	case IVI_SURFACE_ROLE_DESKTOP:
 		ivi_layout_desktop_committed(surface);
+
+		output = surface->desktop.last_output;
+		if (output && output->active == surface)
+			ivi_layout_update_occlusion(output);
 		break;
 	case IVI_SURFACE_ROLE_PANEL:
 		ivi_layout_panel_committed(surface);
+		/* the opaque region might have changed */
+		ivi_layout_update_occlusion(surface->panel.output);
 		break;
-	case IVI_SURFACE_ROLE_NONE:
 	case IVI_SURFACE_ROLE_BACKGROUND:
+		output = surface->bg.output;
+		if (surface->ivi->startup && !output->startup_background) {
+			output->startup_background = true;
+			ivi_startup_instant(surface->ivi,
+					    "first background %s",
+					    output->name);
+		}
+		ivi_layout_update_occlusion(output);
+		break;
+	case IVI_SURFACE_ROLE_NONE:
 	default: /* fall through */
 		break;
 	}
+
+	/* after the layout had a chance to (un)map the view */
+	ivi_surface_schedule_repaint(surface);
 }
 
 static void
@@ -0,0 +1,199 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Flight recorder
+ *
+ * Keeps the last FLIGHT_RECORDER_CAPACITY events (activations, commits,
+ * layer changes, outputs and clients coming and going, repaints) in a static
+ * ring of compact records. The ring is written out to a file on SIGUSR1,
+ * when exiting, and when crashing, from the signal handler, which is why it
+ * lives in static storage and the dump only uses open(), write() and
+ * close(). The dump can be read with agl-compositor-decode-recorder.
+ *
+ * The file is given by flight-recorder in [core], and defaults to
+ * agl-compositor.rec in XDG_RUNTIME_DIR. There is no dump without either:
+ * a fixed name in a world-writable directory would be open to symlink
+ * attacks.
+ */
+
+#include "ivi-compositor.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libweston-6/config-parser.h>
+
+#include "shared/flight-recorder.h"
+#include "shared/helpers.h"
+
+static struct {
+	struct flight_recorder_header header;
+	struct flight_recorder_record records[FLIGHT_RECORDER_CAPACITY];
+	char path[PATH_MAX];
+} recorder = {
+	.header = {
+		.magic = FLIGHT_RECORDER_MAGIC,
+		.version = FLIGHT_RECORDER_VERSION,
+		.record_size = sizeof(struct flight_recorder_record),
+		.capacity = FLIGHT_RECORDER_CAPACITY,
+	},
+};
+
+static const int crash_signals[] = { SIGSEGV, SIGABRT, SIGBUS, SIGFPE, SIGILL };
+
+void
+ivi_flight_record(uint32_t type, uint32_t a, uint64_t b)
+{
+	struct flight_recorder_record *record;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	record = &recorder.records[recorder.header.next++ %
+				   FLIGHT_RECORDER_CAPACITY];
+	record->time = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+	record->type = type;
+	record->a = a;
+	record->b = b;
+}
+
+/* The first 8 bytes of the app_id, enough to tell apps apart */
+void
+ivi_flight_record_app_id(uint32_t type, uint32_t output_id,
+			 const char *app_id)
+{
+	uint64_t b = 0;
+
+	if (app_id)
+		memcpy(&b, app_id, strnlen(app_id, sizeof(b)));
+
+	ivi_flight_record(type, output_id, b);
+}
+
+static int
+write_all(int fd, const void *data, size_t size)
+{
+	const char *p = data;
+
+	while (size > 0) {
+		ssize_t ret = write(fd, p, size);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		p += ret;
+		size -= ret;
+	}
+
+	return 0;
+}
+
+/* Only async-signal-safe calls in here */
+static int
+flight_recorder_write(void)
+{
+	int saved_errno = errno;
+	int fd, ret;
+
+	if (!recorder.path[0])
+		return -1;
+
+	fd = open(recorder.path,
+		  O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW, 0600);
+	if (fd < 0) {
+		errno = saved_errno;
+		return -1;
+	}
+
+	ret = write_all(fd, &recorder.header, sizeof(recorder.header));
+	if (ret == 0)
+		ret = write_all(fd, recorder.records, sizeof(recorder.records));
+	close(fd);
+
+	errno = saved_errno;
+	return ret;
+}
+
+void
+ivi_flight_recorder_dump(void)
+{
+	if (!recorder.path[0])
+		weston_log("Flight recorder not written, "
+			   "XDG_RUNTIME_DIR is not set\n");
+	else if (flight_recorder_write() < 0)
+		weston_log("Failed to write the flight recorder to %s\n",
+			   recorder.path);
+	else
+		weston_log("Flight recorder written to %s\n", recorder.path);
+}
+
+static void
+flight_recorder_crash(int signo, siginfo_t *info, void *context)
+{
+	ivi_flight_record(FLIGHT_RECORDER_SIGNAL, signo,
+			  (uintptr_t) info->si_addr);
+	flight_recorder_write();
+
+	/* SA_RESETHAND brought back the default action */
+	raise(signo);
+}
+
+void
+ivi_flight_recorder_init(struct ivi_compositor *ivi)
+{
+	struct weston_config_section *section;
+	struct sigaction act;
+	char *path;
+
+	section = weston_config_get_section(ivi->config, "core", NULL, NULL);
+	weston_config_section_get_string(section, "flight-recorder", &path,
+					 NULL);
+	if (path) {
+		snprintf(recorder.path, sizeof(recorder.path), "%s", path);
+		free(path);
+	} else if (getenv("XDG_RUNTIME_DIR")) {
+		snprintf(recorder.path, sizeof(recorder.path),
+			 "%s/agl-compositor.rec", getenv("XDG_RUNTIME_DIR"));
+	}
+
+	memset(&act, 0, sizeof(act));
+	act.sa_sigaction = flight_recorder_crash;
+	act.sa_flags = SA_SIGINFO | SA_RESETHAND;
+	sigemptyset(&act.sa_mask);
+
+	for (size_t i = 0; i < ARRAY_LENGTH(crash_signals); i++)
+		sigaction(crash_signals[i], &act, NULL);
+}
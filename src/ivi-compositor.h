@@ -26,7 +26,10 @@
 #ifndef IVI_COMPOSITOR_H
 #define IVI_COMPOSITOR_H
 
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
 #include "config.h"
 
 #include <libweston-6/compositor-drm.h>
@@ -38,6 +41,42 @@
 
 #define ARRAY_LENGTH(x) (sizeof(x) / sizeof((x)[0]))
 
+/* number of buckets in the app_id index, must be a power of two */
+#define IVI_APP_INDEX_SIZE 64
+
+/* see debug.c */
+enum ivi_debug_scope {
+	IVI_DEBUG_LAYOUT = 1 << 0,
+	IVI_DEBUG_SHELL = 1 << 1,
+	IVI_DEBUG_DESKTOP = 1 << 2,
+	IVI_DEBUG_OUTPUT = 1 << 3,
+	IVI_DEBUG_ALL = IVI_DEBUG_LAYOUT | IVI_DEBUG_SHELL |
+			IVI_DEBUG_DESKTOP | IVI_DEBUG_OUTPUT,
+};
+
+struct ivi_debug;
+
+/* see loop-stats.c */
+enum ivi_loop_source {
+	IVI_LOOP_SOURCE_OTHER = 0,
+	IVI_LOOP_SOURCE_CLIENT,
+	IVI_LOOP_SOURCE_TIMER,
+	IVI_LOOP_SOURCE_SIGNAL,
+	IVI_LOOP_SOURCE_FD,
+	IVI_LOOP_SOURCE_IDLE,
+};
+
+struct ivi_loop_stats;
+struct ivi_metrics;
+struct ivi_layout_transaction;
+
+/* see ivi_shell_activation_feedback() */
+enum ivi_activation_stage {
+	IVI_ACTIVATION_ACCEPTED,
+	IVI_ACTIVATION_CONFIGURED,
+	IVI_ACTIVATION_PRESENTED,
+};
+
 struct ivi_compositor {
 	struct weston_compositor *compositor;
 	struct weston_config *config;
@@ -66,15 +105,79 @@ struct ivi_compositor {
 		int activate_apps_by_default;	/* switches once xdg top level has been 'created' */
 	} quirks;
 
+	/*
+	 * Default frame rate cap for views waiting on the hidden layer, can be
+	 * overridden per app_id. See ivi_layout_hidden_committed().
+	 */
+	int hidden_fps;
+
+	/* see ivi_layout_preconfigure() */
+	int preconfigure;
+
+	/*
+	 * Defaults for the number of recently used apps kept ready on each
+	 * output, and their frame rate cap meanwhile. See
+	 * ivi_layout_standby_add().
+	 */
+	int standby_apps;
+	int standby_fps;
+
+	/* how long a transaction waits for its clients, in ms */
+	int transaction_timeout;
+
+	/* enum ivi_debug_scope, tested before formatting anything */
+	uint32_t debug_scopes;
+	struct ivi_debug *debug;
+
+	/* NULL unless loop-stats is enabled */
+	struct ivi_loop_stats *loop_stats;
+
+	/* shared memory page for monitoring, see metrics.c */
+	struct ivi_metrics *metrics;
+
 	struct {
-		struct wl_client *client;
-		struct wl_resource *resource;
+		struct wl_list clients;	/* ivi_shell_client.link */
+		struct wl_list resources; /* agl_shell, wl_resource_get_link() */
+		/* set once the clients with require_ready are all ready */
 		bool ready;
+		/* whether any client called ready at all */
+		bool ready_requested;
 	} shell_client;
 
+	/* shown until the shell client is ready, see splash.c */
+	struct ivi_splash *splash;
+
+	/* start-up trace, NULL once written, see startup.c */
+	struct ivi_startup *startup;
+
+	/*
+	 * Set, and first_frame_signal emitted, once every enabled output
+	 * showed a frame after the shell client got ready.
+	 */
+	bool first_frame_done;
+	struct wl_signal first_frame_signal;
+
 	struct wl_list outputs; /* ivi_output.link */
 	struct wl_list surfaces; /* ivi_surface.link */
 
+	/*
+	 * app_id -> ivi_surface index for the surfaces in 'surfaces'. Each
+	 * bucket keeps its surfaces in insertion order, so that lookups with
+	 * duplicate app_ids resolve deterministically.
+	 */
+	struct wl_list app_index[IVI_APP_INDEX_SIZE]; /* ivi_surface.app_link */
+	/* the same surfaces, by handle */
+	struct wl_list handle_index[IVI_APP_INDEX_SIZE]; /* ivi_surface.handle_link */
+	uint32_t last_handle;
+
+	/* changes not sent yet, see ivi_shell_window_list_flush() */
+	struct {
+		bool pending;
+		struct wl_list changed;	/* ivi_surface.window_list.link */
+		struct wl_array closed;	/* uint32_t handles */
+		struct wl_event_source *timer;
+	} window_list;
+
 	struct weston_desktop *desktop;
 
 	struct wl_list pending_surfaces;
@@ -87,6 +190,8 @@ struct ivi_compositor {
 };
 
 struct ivi_surface;
+struct ivi_splash;
+struct ivi_startup;
 
 struct ivi_output {
 	struct wl_list link; /* ivi_compositor.outputs */
@@ -97,6 +202,11 @@ struct ivi_output {
 	struct weston_output *output;
 
 	struct ivi_surface *background;
+	/*
+	 * The background is taken out of its layer while it is entirely
+	 * covered, see ivi_layout_update_occlusion().
+	 */
+	bool background_occluded;
 	/* Panels */
 	struct ivi_surface *top;
 	struct ivi_surface *bottom;
@@ -110,6 +220,41 @@ struct ivi_output {
 	} fullscreen_view;
 
 	struct wl_listener output_destroy;
+	struct wl_listener output_frame;
+
+	/* pixels damaged by the layout, see ivi_layout_damage_region() */
+	struct {
+		uint64_t pending;	/* since the last repaint */
+		uint64_t last_frame;	/* in the last repaint */
+		uint64_t total;
+	} damage;
+
+	/*
+	 * Surface commits that woke this output up, either through us or
+	 * because libweston does for the outputs the surface is on even when
+	 * it is hidden, and those that no longer do because the surface is on
+	 * other outputs, see ivi_surface_schedule_repaint().
+	 */
+	struct {
+		uint64_t scheduled, avoided;
+	} commit_repaint;
+
+	/* completed repaints, checked by the systemd watchdog */
+	struct {
+		uint64_t count;
+		struct timespec last;	/* CLOCK_MONOTONIC */
+		/* as seen by the previous watchdog check */
+		uint64_t checked_count;
+		bool checked_busy;
+	} frames;
+
+	/*
+	 * Start-up trace milestones: first background commit, first frame at
+	 * all, and first one once the shell client is ready.
+	 */
+	bool startup_background;
+	bool startup_frame;
+	bool startup_ready_frame;
 
 	/*
 	 * Usable area for normal clients, i.e. with panels removed.
@@ -119,6 +264,27 @@ struct ivi_output {
 
 	struct ivi_surface *active;
 
+	/*
+	 * activate_app requests are only acted upon once the current dispatch
+	 * is over, only the last one counts. See ivi_layout_queue_activate().
+	 */
+	struct {
+		char *app_id;
+		uint32_t handle;	/* if app_id is NULL */
+		struct wl_event_source *idle;
+		uint64_t dropped;
+	} queued_activation;
+
+	/* activated since the last repaint, for IVI_ACTIVATION_PRESENTED */
+	char *presented_app_id;
+
+	/* active surface changed since the last window list batch */
+	bool window_list_active;
+
+	/* apps kept ready for switching, most recently used first */
+	struct wl_list standby; /* ivi_surface.standby_link */
+	int standby_max;
+
 	/* Temporary: only used during configuration */
 	size_t add_len;
 	struct weston_head *add[8];
@@ -158,6 +324,35 @@ struct ivi_surface {
 
 	struct wl_list link;
 
+	/* copy of the app_id as found in the app_id index */
+	char *app_id;
+	uint32_t app_id_hash;
+	struct wl_list app_link; /* ivi_compositor.app_index */
+
+	/* for agl_shell.activate_handle, never reused */
+	uint32_t handle;
+	struct wl_list handle_link; /* ivi_compositor.handle_index */
+
+	struct {
+		/* ivi_compositor.window_list.changed, if changed */
+		struct wl_list link;
+		/* part of a batch sent already */
+		bool announced;
+	} window_list;
+
+	/* frame event throttling while on the hidden layer */
+	struct {
+		int fps;	/* < 0: no limit, 0: until the next commit */
+		bool parked;	/* taken off the hidden layer for now */
+		struct wl_event_source *timer;
+	} hidden;
+
+	/* ivi_output.standby, empty when not kept ready */
+	struct wl_list standby_link;
+
+	/* the pending agl_shell_transaction this surface is part of */
+	struct ivi_layout_transaction *transaction;
+
 	struct {
 		enum ivi_surface_flags flags;
 		int32_t x, y;
@@ -174,11 +369,14 @@ struct ivi_surface {
 
 struct ivi_shell_client {
 	struct wl_list link;
+	struct ivi_compositor *ivi;
 	char *command;
 	bool require_ready;
+	bool ready;
 
 	pid_t pid;
 	struct wl_client *client;
+	struct wl_resource *resource;	/* agl_shell */
 
 	struct wl_listener client_destroy;
 };
@@ -196,18 +394,163 @@ ivi_agl_systemd_notify(struct ivi_compositor *ivi)
 }
 #endif
 
+#define ivi_debug(ivi, scope, ...)					\
+	do {								\
+		if ((ivi)->debug_scopes & (scope))			\
+			ivi_debug_log((ivi), (scope), __VA_ARGS__);	\
+	} while (0)
+
+int
+ivi_debug_init(struct ivi_compositor *ivi);
+
+void
+ivi_debug_destroy(struct ivi_compositor *ivi);
+
+void
+ivi_debug_log(struct ivi_compositor *ivi, uint32_t scope, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+void
+ivi_debug_dump(struct ivi_compositor *ivi);
+
+void
+ivi_debug_toggle(struct ivi_compositor *ivi);
+
+void
+ivi_flight_recorder_init(struct ivi_compositor *ivi);
+
+void
+ivi_flight_recorder_dump(void);
+
+void
+ivi_flight_record(uint32_t type, uint32_t a, uint64_t b);
+
+void
+ivi_flight_record_app_id(uint32_t type, uint32_t output_id,
+			 const char *app_id);
+
+void
+ivi_startup_init(struct ivi_compositor *ivi);
+
+void
+ivi_startup_phase(struct ivi_compositor *ivi, const char *name);
+
+void
+ivi_startup_span(struct ivi_compositor *ivi, int64_t start, int64_t end,
+		 const char *fmt, ...)
+	__attribute__((format(printf, 4, 5)));
+
+void
+ivi_startup_instant(struct ivi_compositor *ivi, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+void
+ivi_startup_output_frame(struct ivi_output *output);
+
+void
+ivi_startup_summary(struct ivi_compositor *ivi, char *buf, size_t size);
+
+void
+ivi_startup_finish(struct ivi_compositor *ivi);
+
+int
+ivi_loop_stats_init(struct ivi_compositor *ivi);
+
+void
+ivi_loop_stats_destroy(struct ivi_compositor *ivi);
+
+void
+ivi_loop_stats_run(struct ivi_compositor *ivi);
+
+void
+ivi_loop_stats_stop(struct ivi_compositor *ivi);
+
+void
+ivi_loop_stats_dump(struct ivi_compositor *ivi);
+
+void
+ivi_loop_stats_enter(struct ivi_compositor *ivi, enum ivi_loop_source source);
+
+void
+ivi_loop_stats_leave(struct ivi_compositor *ivi);
+
+int
+ivi_metrics_init(struct ivi_compositor *ivi);
+
+void
+ivi_metrics_destroy(struct ivi_compositor *ivi);
+
+void
+ivi_metrics_client_ignore(struct ivi_compositor *ivi,
+			  struct wl_client *wl_client);
+
+void
+ivi_metrics_surface_added(struct ivi_compositor *ivi,
+			  enum ivi_surface_role role);
+
+void
+ivi_metrics_surface_removed(struct ivi_compositor *ivi,
+			    enum ivi_surface_role role);
+
+void
+ivi_metrics_output_frame(struct ivi_output *output);
+
+void
+ivi_metrics_output_destroyed(struct ivi_output *output);
+
+int
+ivi_log_timestamp(FILE *file, const struct timespec *ts);
+
+int
+ivi_log_async_start(FILE *file);
+
+void
+ivi_log_async_stop(void);
+
+int
+ivi_log_async_vprintf(bool timestamp, const char *fmt, va_list ap);
+
 int
 ivi_shell_init(struct ivi_compositor *ivi);
 
 void
 ivi_shell_init_black_fs(struct ivi_compositor *ivi);
 
+void
+ivi_splash_init(struct ivi_compositor *ivi);
+
+void
+ivi_splash_destroy(struct ivi_compositor *ivi);
+
 int
 ivi_shell_create_global(struct ivi_compositor *ivi);
 
 int
 ivi_launch_shell_client(struct ivi_compositor *ivi);
 
+void
+ivi_shell_check_ready(struct ivi_compositor *ivi);
+
+void
+ivi_shell_activation_feedback(struct ivi_compositor *ivi, const char *app_id,
+			      enum ivi_activation_stage stage);
+
+void
+ivi_shell_activation_failed(struct ivi_compositor *ivi, const char *app_id,
+			    enum agl_shell_activate_error error);
+
+void
+ivi_shell_toplevel_changed(struct ivi_surface *surface);
+
+void
+ivi_shell_toplevel_closed(struct ivi_surface *surface);
+
+void
+ivi_shell_toplevel_activated(struct ivi_output *output);
+
+void
+ivi_shell_window_list_flush(struct ivi_compositor *ivi);
+
 int
 ivi_desktop_init(struct ivi_compositor *ivi);
 
@@ -217,6 +560,9 @@ ivi_shell_client_from_wl(struct wl_client *client);
 struct ivi_output *
 to_ivi_output(struct weston_output *o);
 
+void
+ivi_surface_set_role(struct ivi_surface *surface, enum ivi_surface_role role);
+
 void
 ivi_set_desktop_surface(struct ivi_surface *surface);
 
@@ -240,13 +586,86 @@ ivi_layout_commit(struct ivi_compositor *ivi);
 void
 ivi_layout_init(struct ivi_compositor *ivi, struct ivi_output *output);
 
+void
+ivi_layout_preconfigure(struct ivi_surface *surf);
+
+void
+ivi_layout_standby_remove(struct ivi_surface *surf);
+
 void
 ivi_layout_activate(struct ivi_output *output, const char *app_id);
 
+void
+ivi_layout_queue_activate(struct ivi_output *output, const char *app_id);
+
+void
+ivi_layout_activate_handle(struct ivi_output *output, uint32_t handle);
+
+void
+ivi_layout_queue_activate_handle(struct ivi_output *output, uint32_t handle);
+
+void
+ivi_layout_damage_region(struct ivi_compositor *ivi, pixman_region32_t *region);
+
+void
+ivi_layout_damage_view(struct ivi_compositor *ivi, struct weston_view *view);
+
+void
+ivi_layer_insert(struct weston_layer *layer, struct weston_view *view);
+
+void
+ivi_layer_remove(struct weston_view *view);
+
+void
+ivi_layout_init_app_index(struct ivi_compositor *ivi);
+
+void
+ivi_layout_update_app_id(struct ivi_surface *surf);
+
+void
+ivi_layout_remove_app_id(struct ivi_surface *surf);
+
 void
 ivi_layout_desktop_committed(struct ivi_surface *surf);
 
+void
+ivi_layout_update_occlusion(struct ivi_output *output);
+
+void
+ivi_layout_hidden_reset(struct ivi_surface *surf);
+
 void
 ivi_layout_panel_committed(struct ivi_surface *surface);
 
+struct ivi_layout_transaction *
+ivi_layout_transaction_create(struct ivi_compositor *ivi,
+			      void (*done)(void *data), void *data);
+
+void
+ivi_layout_transaction_destroy(struct ivi_layout_transaction *transaction);
+
+int
+ivi_layout_transaction_set_background(struct ivi_layout_transaction *transaction,
+				      struct ivi_output *output,
+				      struct ivi_surface *surface);
+
+int
+ivi_layout_transaction_set_panel(struct ivi_layout_transaction *transaction,
+				 struct ivi_output *output,
+				 struct ivi_surface *surface,
+				 enum agl_shell_edge edge);
+
+int
+ivi_layout_transaction_activate(struct ivi_layout_transaction *transaction,
+				struct ivi_output *output, const char *app_id);
+
+void
+ivi_layout_transaction_commit(struct ivi_layout_transaction *transaction);
+
+bool
+ivi_layout_transaction_surface_committed(struct ivi_surface *surface);
+
+void
+ivi_layout_transaction_surface_removed(struct ivi_surface *surface);
+
 #endif
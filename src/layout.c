@@ -24,14 +24,36 @@
  */
 
 #include "ivi-compositor.h"
+#include "shared/helpers.h"
 
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <libweston-6/compositor.h>
+#include <libweston-6/config-parser.h>
 #include <libweston-6/libweston-desktop.h>
 
-#define AGL_COMP_DEBUG
+#include "shared/flight-recorder.h"
+
+/* weston_layer_entry_insert()/_remove(), leaving a trace in the recorder */
+void
+ivi_layer_insert(struct weston_layer *layer, struct weston_view *view)
+{
+	ivi_flight_record(FLIGHT_RECORDER_LAYER_INSERT, layer->position,
+			  (uintptr_t) view);
+	weston_layer_entry_insert(&layer->view_list, &view->layer_link);
+}
+
+void
+ivi_layer_remove(struct weston_view *view)
+{
+	struct weston_layer *layer = view->layer_link.layer;
+
+	ivi_flight_record(FLIGHT_RECORDER_LAYER_REMOVE,
+			  layer ? layer->position : 0, (uintptr_t) view);
+	weston_layer_entry_remove(&view->layer_link);
+}
 
 static void
 ivi_background_init(struct ivi_compositor *ivi, struct ivi_output *output)
@@ -52,15 +74,14 @@ ivi_background_init(struct ivi_compositor *ivi, struct ivi_output *output)
 	weston_view_set_output(view, woutput);
 	weston_view_set_position(view, woutput->x, woutput->y);
 
-#ifdef AGL_COMP_DEBUG
-	weston_log("(background) position view %p, x %d, y %d\n", view,
-			woutput->x, woutput->y);
-#endif
+	ivi_debug(ivi, IVI_DEBUG_LAYOUT,
+		  "(background) position view %p, x %d, y %d\n", view,
+		  woutput->x, woutput->y);
 
 	view->is_mapped = true;
 	view->surface->is_mapped = true;
 
-	weston_layer_entry_insert(&ivi->background.view_list, &view->layer_link);
+	ivi_layer_insert(&ivi->background, view);
 }
 
 static void
@@ -81,10 +102,9 @@ ivi_panel_init(struct ivi_compositor *ivi, struct ivi_output *output,
 	dsurface = panel->dsurface;
 	view = panel->view;
 	geom = weston_desktop_surface_get_geometry(dsurface);
-#ifdef AGL_COMP_DEBUG
-	weston_log("geom.width %d, geom.height %d, geom.x %d, geom.y %d\n",
-			geom.width, geom.height, geom.x, geom.y);
-#endif
+	ivi_debug(ivi, IVI_DEBUG_LAYOUT,
+		  "geom.width %d, geom.height %d, geom.x %d, geom.y %d\n",
+		  geom.width, geom.height, geom.x, geom.y);
 	switch (panel->panel.edge) {
 	case AGL_SHELL_EDGE_TOP:
 		output->area.y += geom.height;
@@ -109,16 +129,15 @@ ivi_panel_init(struct ivi_compositor *ivi, struct ivi_output *output,
 
 	weston_view_set_output(view, woutput);
 	weston_view_set_position(view, x, y);
-#ifdef AGL_COMP_DEBUG
-	weston_log("(panel) edge %d position view %p, x %d, y %d\n",
-			panel->panel.edge, view, x, y);
-#endif
+	ivi_debug(ivi, IVI_DEBUG_LAYOUT,
+		  "(panel) edge %d position view %p, x %d, y %d\n",
+		  panel->panel.edge, view, x, y);
 
 	/* this is necessary for cases we already mapped it desktop_committed()
 	 * but we not running the older qtwayland, so we still have a chance
 	 * for this to run at the next test */
 	if (view->surface->is_mapped) {
-		weston_layer_entry_remove(&view->layer_link);
+		ivi_layer_remove(view);
 
 		view->is_mapped = false;
 		view->surface->is_mapped = false;
@@ -133,10 +152,9 @@ ivi_panel_init(struct ivi_compositor *ivi, struct ivi_output *output,
 
 	view->is_mapped = true;
 	view->surface->is_mapped = true;
-#ifdef AGL_COMP_DEBUG
-	weston_log("panel type %d inited\n", panel->panel.edge);
-#endif
-	weston_layer_entry_insert(&ivi->panel.view_list, &view->layer_link);
+	ivi_debug(ivi, IVI_DEBUG_LAYOUT, "panel type %d inited\n",
+		  panel->panel.edge);
+	ivi_layer_insert(&ivi->panel, view);
 }
 
 /*
@@ -152,6 +170,9 @@ ivi_layout_init(struct ivi_compositor *ivi, struct ivi_output *output)
 	output->area.width = output->output->width;
 	output->area.height = output->output->height;
 
+	weston_config_section_get_int(output->config, "standby-apps",
+				      &output->standby_max, ivi->standby_apps);
+
 	ivi_panel_init(ivi, output, output->top);
 	ivi_panel_init(ivi, output, output->bottom);
 	ivi_panel_init(ivi, output, output->left);
@@ -164,19 +185,345 @@ ivi_layout_init(struct ivi_compositor *ivi, struct ivi_output *output)
 		   output->area.x, output->area.y);
 }
 
+/*
+ * Adds 'region', in global coordinates, to the damage of the outputs it
+ * covers. Unlike weston_output_damage() this only repaints what actually
+ * changed, e.g. just the application area when switching apps, leaving
+ * panels and background alone.
+ */
+void
+ivi_layout_damage_region(struct ivi_compositor *ivi, pixman_region32_t *region)
+{
+	struct weston_compositor *ec = ivi->compositor;
+	struct ivi_output *output;
+	pixman_region32_t damage;
+
+	pixman_region32_init(&damage);
+
+	wl_list_for_each(output, &ivi->outputs, link) {
+		struct weston_output *woutput = output->output;
+		pixman_box32_t *rects;
+		uint64_t pixels = 0;
+		int n;
+
+		if (!woutput || !woutput->enabled)
+			continue;
+
+		pixman_region32_intersect(&damage, region, &woutput->region);
+		if (!pixman_region32_not_empty(&damage))
+			continue;
+
+		rects = pixman_region32_rectangles(&damage, &n);
+		for (int i = 0; i < n; i++)
+			pixels += (uint64_t) (rects[i].x2 - rects[i].x1) *
+				  (rects[i].y2 - rects[i].y1);
+
+		output->damage.pending += pixels;
+		output->damage.total += pixels;
+
+		pixman_region32_union(&ec->primary_plane.damage,
+				      &ec->primary_plane.damage, &damage);
+		weston_output_schedule_repaint(woutput);
+	}
+
+	pixman_region32_fini(&damage);
+}
+
+void
+ivi_layout_damage_view(struct ivi_compositor *ivi, struct weston_view *view)
+{
+	ivi_layout_damage_region(ivi, &view->transform.boundingbox);
+}
+
+static uint32_t
+ivi_app_id_hash(const char *app_id)
+{
+	/* FNV-1a */
+	uint32_t hash = 2166136261u;
+
+	for (; *app_id; app_id++) {
+		hash ^= (uint8_t) *app_id;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static struct wl_list *
+ivi_app_index_bucket(struct ivi_compositor *ivi, uint32_t hash)
+{
+	return &ivi->app_index[hash & (IVI_APP_INDEX_SIZE - 1)];
+}
+
+void
+ivi_layout_init_app_index(struct ivi_compositor *ivi)
+{
+	for (size_t i = 0; i < ARRAY_LENGTH(ivi->app_index); i++) {
+		wl_list_init(&ivi->app_index[i]);
+		wl_list_init(&ivi->handle_index[i]);
+	}
+}
+
+static void
+ivi_layout_unindex(struct ivi_surface *surf)
+{
+	wl_list_remove(&surf->app_link);
+	wl_list_init(&surf->app_link);
+	wl_list_remove(&surf->handle_link);
+	wl_list_init(&surf->handle_link);
+
+	free(surf->app_id);
+	surf->app_id = NULL;
+}
+
+void
+ivi_layout_remove_app_id(struct ivi_surface *surf)
+{
+	if (surf->app_id)
+		ivi_shell_toplevel_closed(surf);
+
+	ivi_layout_unindex(surf);
+}
+
+/*
+ * Brings the app_id index up to date with the app_id of the desktop surface.
+ * libweston-desktop does not tell us when xdg_toplevel.set_app_id is called,
+ * so this gets called on every commit; the common case is a single string
+ * compare against the cached copy.
+ */
+void
+ivi_layout_update_app_id(struct ivi_surface *surf)
+{
+	const char *app_id = weston_desktop_surface_get_app_id(surf->dsurface);
+	struct weston_config_section *section;
+	bool learned;
+
+	if (surf->app_id && app_id && strcmp(surf->app_id, app_id) == 0)
+		return;
+
+	if (!surf->app_id && !app_id)
+		return;
+
+	/* only surfaces on ivi->surfaces are eligible for activation */
+	if (!app_id || wl_list_empty(&surf->link)) {
+		ivi_layout_remove_app_id(surf);
+		return;
+	}
+
+	/* a change of app_id keeps the handle */
+	learned = !surf->app_id;
+	ivi_layout_unindex(surf);
+
+	surf->app_id = strdup(app_id);
+	if (!surf->app_id) {
+		ivi_shell_toplevel_closed(surf);
+		return;
+	}
+
+	surf->app_id_hash = ivi_app_id_hash(app_id);
+	wl_list_insert(ivi_app_index_bucket(surf->ivi, surf->app_id_hash)->prev,
+		       &surf->app_link);
+	wl_list_insert(&surf->ivi->handle_index[surf->handle &
+						(IVI_APP_INDEX_SIZE - 1)],
+		       &surf->handle_link);
+	ivi_shell_toplevel_changed(surf);
+
+	/* [application] sections keyed by app-id can override the policy */
+	section = weston_config_get_section(surf->ivi->config, "application",
+					    "app-id", app_id);
+	weston_config_section_get_int(section, "hidden-fps", &surf->hidden.fps,
+				      surf->ivi->hidden_fps);
+
+	if (learned)
+		ivi_layout_preconfigure(surf);
+}
+
+/*
+ * If multiple surfaces have the same app_id, prefer the one last shown on
+ * (or being activated on) 'output', otherwise the oldest one.
+ */
 static struct ivi_surface *
-ivi_find_app(struct ivi_compositor *ivi, const char *app_id)
+ivi_find_app(struct ivi_compositor *ivi, const char *app_id,
+	     struct ivi_output *output)
 {
-	struct ivi_surface *surf;
-	const char *id;
+	struct ivi_surface *surf, *found = NULL;
+	uint32_t hash = ivi_app_id_hash(app_id);
+
+	wl_list_for_each(surf, ivi_app_index_bucket(ivi, hash), app_link) {
+		if (surf->app_id_hash != hash || strcmp(app_id, surf->app_id))
+			continue;
 
-	wl_list_for_each(surf, &ivi->surfaces, link) {
-		id = weston_desktop_surface_get_app_id(surf->dsurface);
-		if (id && strcmp(app_id, id) == 0)
+		if (surf->desktop.last_output == output ||
+		    surf->desktop.pending_output == output)
 			return surf;
+
+		if (!found)
+			found = surf;
 	}
 
-	return NULL;
+	return found;
+}
+
+/*
+ * Views waiting on the hidden layer for an activation to complete get frame
+ * events at the full refresh rate. Apps that never finish that because
+ * another app got activated on the same output in the meantime, which
+ * clears their pending_output, would keep rendering in the background
+ * forever. Depending on the hidden-fps policy of the app we take the view
+ * off the hidden layer after it committed, so that it doesn't get any frame
+ * events, and put it back after 1/hidden-fps seconds. With a policy of 0 it
+ * only goes back when it is activated again. The app currently being
+ * activated is never throttled, whatever it commits until it has the right
+ * size.
+ */
+static void
+ivi_layout_hidden_unpark(struct ivi_surface *surf)
+{
+	struct weston_view *view = surf->view;
+
+	if (!surf->hidden.parked)
+		return;
+
+	surf->hidden.parked = false;
+	if (surf->hidden.timer)
+		wl_event_source_timer_update(surf->hidden.timer, 0);
+
+	ivi_layer_insert(&surf->ivi->hidden, view);
+	if (view->output)
+		weston_output_schedule_repaint(view->output);
+}
+
+static int
+ivi_layout_hidden_timer(void *data)
+{
+	struct ivi_surface *surf = data;
+
+	ivi_loop_stats_enter(surf->ivi, IVI_LOOP_SOURCE_TIMER);
+	ivi_layout_hidden_unpark(surf);
+	ivi_loop_stats_leave(surf->ivi);
+
+	return 0;
+}
+
+static void
+ivi_layout_hidden_committed(struct ivi_surface *surf)
+{
+	struct ivi_compositor *ivi = surf->ivi;
+	struct weston_view *view = surf->view;
+	int fps = wl_list_empty(&surf->standby_link) ?
+		  surf->hidden.fps : ivi->standby_fps;
+
+	if (fps < 0 || view->layer_link.layer != &ivi->hidden)
+		return;
+
+	ivi_layer_remove(view);
+	surf->hidden.parked = true;
+
+	if (fps == 0)
+		return;
+
+	if (!surf->hidden.timer) {
+		struct wl_event_loop *loop =
+			wl_display_get_event_loop(ivi->compositor->wl_display);
+
+		surf->hidden.timer =
+			wl_event_loop_add_timer(loop, ivi_layout_hidden_timer,
+						surf);
+		if (!surf->hidden.timer) {
+			ivi_layout_hidden_unpark(surf);
+			return;
+		}
+	}
+
+	wl_event_source_timer_update(surf->hidden.timer, MAX(1000 / fps, 1));
+}
+
+/*
+ * Forgets about the throttling, for when the view moves elsewhere or goes
+ * away.
+ */
+void
+ivi_layout_hidden_reset(struct ivi_surface *surf)
+{
+	surf->hidden.parked = false;
+
+	if (surf->hidden.timer) {
+		wl_event_source_remove(surf->hidden.timer);
+		surf->hidden.timer = NULL;
+	}
+}
+
+static void
+ivi_layout_standby_evict(struct ivi_surface *surf)
+{
+	struct weston_view *view = surf->view;
+
+	ivi_debug(surf->ivi, IVI_DEBUG_LAYOUT, "%s leaves standby\n",
+		  surf->app_id ? surf->app_id : "no app_id");
+
+	wl_list_remove(&surf->standby_link);
+	wl_list_init(&surf->standby_link);
+	ivi_layout_hidden_reset(surf);
+
+	view->is_mapped = false;
+	view->surface->is_mapped = false;
+	ivi_layer_remove(view);
+}
+
+/*
+ * Up to standby-apps, from the [output] section or else [shell], of the apps
+ * last active on an output are kept ready to be switched back to rather than
+ * unmapped: they stay maximized to the output area on the hidden layer, with
+ * their last buffer, getting frame events at up to standby-fps, 1 by default,
+ * through the same throttling as views waiting for their activation. Their
+ * activation is then only a layer change. The least recently used app goes
+ * when there are too many of them.
+ *
+ * Returns false when the app is not kept.
+ */
+static bool
+ivi_layout_standby_add(struct ivi_output *output, struct ivi_surface *surf)
+{
+	struct ivi_compositor *ivi = output->ivi;
+	struct weston_desktop_surface *dsurf = surf->dsurface;
+	struct weston_geometry geom = weston_desktop_surface_get_geometry(dsurf);
+	struct ivi_surface *iter, *tmp;
+	int count = 0;
+
+	if (output->standby_max <= 0)
+		return false;
+
+	wl_list_remove(&surf->standby_link);
+	wl_list_insert(&output->standby, &surf->standby_link);
+
+	ivi_layer_remove(surf->view);
+	ivi_layer_insert(&ivi->hidden, surf->view);
+
+	/* e.g. when the panels changed since it got activated */
+	if (!weston_desktop_surface_get_maximized(dsurf) ||
+	    geom.width != output->area.width ||
+	    geom.height != output->area.height) {
+		weston_desktop_surface_set_maximized(dsurf, true);
+		weston_desktop_surface_set_size(dsurf, output->area.width,
+						output->area.height);
+	}
+
+	ivi_debug(ivi, IVI_DEBUG_LAYOUT, "%s on standby on output %s\n",
+		  surf->app_id ? surf->app_id : "no app_id", output->name);
+
+	wl_list_for_each_safe(iter, tmp, &output->standby, standby_link)
+		if (++count > output->standby_max)
+			ivi_layout_standby_evict(iter);
+
+	return true;
+}
+
+/* For when the app gets activated or goes away */
+void
+ivi_layout_standby_remove(struct ivi_surface *surf)
+{
+	wl_list_remove(&surf->standby_link);
+	wl_list_init(&surf->standby_link);
 }
 
 static void
@@ -186,9 +533,35 @@ ivi_layout_activate_complete(struct ivi_output *output,
 	struct ivi_compositor *ivi = output->ivi;
 	struct weston_output *woutput = output->output;
 	struct weston_view *view = surf->view;
+	pixman_region32_t damage;
+
+	/* the output can go away while the surface is still on its way */
+	if (!woutput) {
+		surf->desktop.pending_output = NULL;
+		return;
+	}
+
+	ivi_flight_record_app_id(FLIGHT_RECORDER_ACTIVATE_DONE,
+				 woutput->id, surf->app_id);
+
+	/*
+	 * The app area changes, plus wherever the old and new active views
+	 * were or are now, in case they don't exactly cover the area.
+	 */
+	pixman_region32_init_rect(&damage,
+				  woutput->x + output->area.x,
+				  woutput->y + output->area.y,
+				  output->area.width, output->area.height);
+
+	ivi_layout_hidden_reset(surf);
+	ivi_layout_standby_remove(surf);
 
 	if (weston_view_is_mapped(view)) {
-		weston_layer_entry_remove(&view->layer_link);
+		/* views on the hidden layer were never visible */
+		if (view->layer_link.layer != &ivi->hidden)
+			pixman_region32_union(&damage, &damage,
+					      &view->transform.boundingbox);
+		ivi_layer_remove(view);
 	}
 
 	weston_view_set_output(view, woutput);
@@ -200,20 +573,116 @@ ivi_layout_activate_complete(struct ivi_output *output,
 	view->surface->is_mapped = true;
 
 	if (output->active) {
-		output->active->view->is_mapped = false;
-		output->active->view->surface->is_mapped = false;
+		struct weston_view *active_view = output->active->view;
+
+		pixman_region32_union(&damage, &damage,
+				      &active_view->transform.boundingbox);
 
-		weston_layer_entry_remove(&output->active->view->layer_link);
+		if (!ivi_layout_standby_add(output, output->active)) {
+			active_view->is_mapped = false;
+			active_view->surface->is_mapped = false;
+
+			ivi_layer_remove(active_view);
+		}
 	}
 	output->active = surf;
 
-	weston_layer_entry_insert(&ivi->normal.view_list, &view->layer_link);
+	ivi_layer_insert(&ivi->normal, view);
 	weston_view_update_transform(view);
 
-	/* force repaint of the entire output */
-	weston_output_damage(output->output);
-	surf->desktop.last_output = surf->desktop.pending_output;
+	pixman_region32_union(&damage, &damage, &view->transform.boundingbox);
+	ivi_layout_damage_region(ivi, &damage);
+	pixman_region32_fini(&damage);
+
+	/* pending_output isn't set when completing on the spot */
+	if (surf->desktop.last_output != output) {
+		surf->desktop.last_output = output;
+		ivi_shell_toplevel_changed(surf);
+	}
 	surf->desktop.pending_output = NULL;
+	ivi_shell_toplevel_activated(output);
+
+	ivi_layout_update_occlusion(output);
+
+	/* the next repaint of the output is the one showing it */
+	ivi_shell_activation_feedback(ivi, surf->app_id,
+				      IVI_ACTIVATION_CONFIGURED);
+	free(output->presented_app_id);
+	output->presented_app_id = surf->app_id ? strdup(surf->app_id) : NULL;
+}
+
+static void
+ivi_layout_add_opaque(pixman_region32_t *opaque, struct ivi_surface *surf,
+		      struct weston_layer *layer)
+{
+	struct weston_view *view;
+
+	if (!surf)
+		return;
+
+	view = surf->view;
+	if (view->layer_link.layer != layer)
+		return;
+
+	weston_view_update_transform(view);
+	pixman_region32_union(opaque, opaque, &view->transform.opaque);
+}
+
+/*
+ * When the panels and the active app together cover the whole background
+ * with opaque content, the background can't be seen. Take it out of the
+ * background layer in that case, so that it is skipped entirely when
+ * compositing and its client stops getting frame events, until it becomes
+ * visible again.
+ */
+void
+ivi_layout_update_occlusion(struct ivi_output *output)
+{
+	struct ivi_compositor *ivi = output->ivi;
+	struct ivi_surface *bg = output->background;
+	struct weston_view *view;
+	pixman_region32_t opaque;
+	bool occluded = false;
+
+	if (!bg || !output->output || !ivi->shell_client.ready)
+		return;
+
+	view = bg->view;
+	weston_view_update_transform(view);
+
+	pixman_region32_init(&opaque);
+
+	ivi_layout_add_opaque(&opaque, output->active, &ivi->normal);
+	ivi_layout_add_opaque(&opaque, output->top, &ivi->panel);
+	ivi_layout_add_opaque(&opaque, output->bottom, &ivi->panel);
+	ivi_layout_add_opaque(&opaque, output->left, &ivi->panel);
+	ivi_layout_add_opaque(&opaque, output->right, &ivi->panel);
+
+	if (pixman_region32_not_empty(&view->transform.boundingbox)) {
+		pixman_box32_t *box =
+			pixman_region32_extents(&view->transform.boundingbox);
+
+		occluded = pixman_region32_contains_rectangle(&opaque, box) ==
+			   PIXMAN_REGION_IN;
+	}
+
+	pixman_region32_fini(&opaque);
+
+	if (occluded == output->background_occluded)
+		return;
+
+	output->background_occluded = occluded;
+
+	if (occluded) {
+		ivi_layer_remove(view);
+	} else {
+		ivi_layer_insert(&ivi->background, view);
+		/* it may have changed while it wasn't shown */
+		weston_surface_damage(view->surface);
+	}
+
+	ivi_debug(output->ivi, IVI_DEBUG_LAYOUT, "(background) output %s %s\n",
+		  output->name, occluded ? "occluded" : "visible");
 }
 
 static struct ivi_output *
@@ -240,6 +709,14 @@ ivi_layout_desktop_committed(struct ivi_surface *surf)
 	assert(surf->role == IVI_SURFACE_ROLE_DESKTOP);
 
 	output = surf->desktop.pending_output;
+	/* on standby, or its activation got abandoned */
+	if (!output && (!wl_list_empty(&surf->standby_link) ||
+			surf->hidden.parked ||
+			surf->view->layer_link.layer == &surf->ivi->hidden)) {
+		ivi_layout_hidden_committed(surf);
+		return;
+	}
+
 	if (!output) {
 		struct ivi_output *ivi_bg_output;
 
@@ -262,6 +739,7 @@ ivi_layout_desktop_committed(struct ivi_surface *surf)
 		return;
 	}
 
+	/* e.g. a frame it had in flight before handling the configure */
 	if (!weston_desktop_surface_get_maximized(dsurf) ||
 	    geom.width != output->area.width ||
 	    geom.height != output->area.height)
@@ -302,10 +780,9 @@ ivi_layout_panel_committed(struct ivi_surface *surface)
 
 	geom = weston_desktop_surface_get_geometry(dsurface);
 
-#ifdef AGL_COMP_DEBUG
-	weston_log("geom.width %d, geom.height %d, geom.x %d, geom.y %d\n",
-			geom.width, geom.height, geom.x, geom.y);
-#endif
+	ivi_debug(ivi, IVI_DEBUG_LAYOUT,
+		  "geom.width %d, geom.height %d, geom.x %d, geom.y %d\n",
+		  geom.width, geom.height, geom.x, geom.y);
 
 	switch (surface->panel.edge) {
 	case AGL_SHELL_EDGE_TOP:
@@ -321,14 +798,12 @@ ivi_layout_panel_committed(struct ivi_surface *surface)
 		x += woutput->width - geom.width;
 		break;
 	}
-#ifndef AGL_COMP_DEBUG
-	weston_log("panel type %d commited\n", surface->panel.edge);
-#endif
+	ivi_debug(ivi, IVI_DEBUG_LAYOUT, "panel type %d commited\n",
+		  surface->panel.edge);
 
 	weston_view_set_output(surface->view, woutput);
 	weston_view_set_position(surface->view, x, y);
-	weston_layer_entry_insert(&ivi->panel.view_list,
-				  &surface->view->layer_link);
+	ivi_layer_insert(&ivi->panel, surface->view);
 
 	weston_view_update_transform(surface->view);
 	weston_view_schedule_repaint(surface->view);
@@ -337,54 +812,1072 @@ ivi_layout_panel_committed(struct ivi_surface *surface)
 	surface->view->is_mapped = true;
 }
 
+/*
+ * The output the surface will most likely be activated on: the one given by
+ * output in its [application] section, or else the one with the background,
+ * which activate-by-default uses as well.
+ */
+static struct ivi_output *
+ivi_layout_preconfigure_output(struct ivi_surface *surf)
+{
+	struct ivi_compositor *ivi = surf->ivi;
+	struct weston_config_section *section;
+	struct ivi_output *output = NULL;
+	char *name = NULL;
+
+	if (surf->app_id) {
+		section = weston_config_get_section(ivi->config, "application",
+						    "app-id", surf->app_id);
+		weston_config_section_get_string(section, "output", &name,
+						 NULL);
+	}
+
+	if (name) {
+		struct ivi_output *iter;
+
+		wl_list_for_each(iter, &ivi->outputs, link) {
+			if (iter->output && strcmp(iter->name, name) == 0) {
+				output = iter;
+				break;
+			}
+		}
+		free(name);
+	}
+
+	if (!output)
+		output = ivi_layout_find_bg_output(ivi);
+
+	return output;
+}
+
+/*
+ * With preconfigure in [shell], desktop surfaces are sent the size they will
+ * be shown at as soon as they become eligible for activation, rather than on
+ * their first activation. Their first buffer then has the right size
+ * already, and ivi_layout_activate() can complete on the spot instead of
+ * waiting for a configure round trip and a redraw.
+ *
+ * This runs once the app_id is known, as the output may come from its
+ * [application] section: usually on the commit before the initial configure,
+ * or when a surface held back until the shell client got ready is let in.
+ * Surfaces without an app_id can't be activated and are left alone.
+ */
 void
-ivi_layout_activate(struct ivi_output *output, const char *app_id)
+ivi_layout_preconfigure(struct ivi_surface *surf)
 {
-	struct ivi_compositor *ivi = output->ivi;
-	struct ivi_surface *surf;
-	struct weston_desktop_surface *dsurf;
-	struct weston_view *view;
-	struct weston_geometry geom;
+	struct weston_desktop_surface *dsurf = surf->dsurface;
+	struct ivi_output *output;
 
-	surf = ivi_find_app(ivi, app_id);
-	if (!surf)
-		return;
-#ifdef AGL_COMP_DEBUG
-	weston_log("Found app_id %s\n", app_id);
-#endif
-	if (surf == output->active)
+	if (!surf->ivi->preconfigure)
 		return;
 
-	dsurf = surf->dsurface;
-	view = surf->view;
-	geom = weston_desktop_surface_get_geometry(dsurf);
-
-	if (weston_desktop_surface_get_maximized(dsurf) &&
-	    geom.width == output->area.width &&
-	    geom.height == output->area.height) {
-		ivi_layout_activate_complete(output, surf);
+	output = ivi_layout_preconfigure_output(surf);
+	if (!output || output->area.width <= 0 || output->area.height <= 0)
 		return;
-	}
+
+	ivi_debug(surf->ivi, IVI_DEBUG_LAYOUT,
+		  "preconfiguring %s to %dx%d for output %s\n",
+		  surf->app_id ? surf->app_id : "no app_id",
+		  output->area.width, output->area.height, output->name);
 
 	weston_desktop_surface_set_maximized(dsurf, true);
-	weston_desktop_surface_set_size(dsurf,
-					output->area.width,
+	weston_desktop_surface_set_size(dsurf, output->area.width,
 					output->area.height);
+}
 
-	/*
-	 * If the view isn't mapped, we put it onto the hidden layer so it will
-	 * start receiving frame events, and will be able to act on our
-	 * configure event.
-	 */
-	if (!weston_view_is_mapped(view)) {
-		view->is_mapped = true;
-		view->surface->is_mapped = true;
+static void
+ivi_layout_activate_queued(void *data)
+{
+	struct ivi_output *output = data;
+	struct ivi_compositor *ivi = output->ivi;
+	char *app_id = output->queued_activation.app_id;
+	uint32_t handle = output->queued_activation.handle;
+
+	ivi_loop_stats_enter(ivi, IVI_LOOP_SOURCE_IDLE);
+
+	output->queued_activation.app_id = NULL;
+	output->queued_activation.handle = 0;
+	output->queued_activation.idle = NULL;
+
+	/* the output might have gone away in the meantime */
+	if (output->output && app_id)
+		ivi_layout_activate(output, app_id);
+	else if (output->output)
+		ivi_layout_activate_handle(output, handle);
+	free(app_id);
+
+	ivi_loop_stats_leave(ivi);
+}
+
+static struct ivi_surface *
+ivi_find_handle(struct ivi_compositor *ivi, uint32_t handle)
+{
+	struct ivi_surface *surf;
+
+	wl_list_for_each(surf, &ivi->handle_index[handle & (IVI_APP_INDEX_SIZE - 1)],
+			 handle_link)
+		if (surf->handle == handle)
+			return surf;
+
+	return NULL;
+}
+
+/* Either 'app_id', which is taken over, or 'handle' */
+static void
+ivi_layout_queue(struct ivi_output *output, char *app_id, uint32_t handle)
+{
+	struct ivi_compositor *ivi = output->ivi;
+	struct wl_event_loop *loop =
+		wl_display_get_event_loop(ivi->compositor->wl_display);
+	const char *superseded = output->queued_activation.app_id;
+
+	if (superseded || output->queued_activation.handle) {
+		if (!superseded) {
+			struct ivi_surface *surf =
+				ivi_find_handle(ivi,
+						output->queued_activation.handle);
+
+			superseded = surf ? surf->app_id : "";
+		}
+
+		ivi_debug(ivi, IVI_DEBUG_LAYOUT,
+			  "activation of %s on output %s superseded\n",
+			  superseded, output->name);
+		ivi_shell_activation_failed(ivi, superseded,
+					    AGL_SHELL_ACTIVATE_ERROR_SUPERSEDED);
+		output->queued_activation.dropped++;
+		free(output->queued_activation.app_id);
+	}
+	output->queued_activation.app_id = app_id;
+	output->queued_activation.handle = handle;
+
+	if (output->queued_activation.idle)
+		return;
+
+	output->queued_activation.idle =
+		wl_event_loop_add_idle(loop, ivi_layout_activate_queued,
+				       output);
+	if (!output->queued_activation.idle)
+		ivi_layout_activate_queued(output);
+}
+
+/*
+ * A burst of activate_app requests, e.g. from quick taps in the homescreen,
+ * would have every app in it configured to the output size and redrawing,
+ * only for the last one to be shown. Only the last request per output that
+ * arrived during a dispatch gets through, from an idle callback at the end
+ * of it; the others are counted and dropped.
+ */
+void
+ivi_layout_queue_activate(struct ivi_output *output, const char *app_id)
+{
+	char *copy;
+
+	copy = strdup(app_id);
+	if (!copy) {
+		ivi_layout_activate(output, app_id);
+		return;
+	}
+
+	ivi_layout_queue(output, copy, 0);
+}
+
+/* Same as ivi_layout_queue_activate(), for agl_shell.activate_handle */
+void
+ivi_layout_queue_activate_handle(struct ivi_output *output, uint32_t handle)
+{
+	ivi_layout_queue(output, NULL, handle);
+}
+
+static void
+ivi_layout_activate_surface(struct ivi_output *output,
+			    struct ivi_surface *surf);
+
+void
+ivi_layout_activate(struct ivi_output *output, const char *app_id)
+{
+	struct ivi_compositor *ivi = output->ivi;
+	struct ivi_surface *surf;
+
+	ivi_flight_record_app_id(FLIGHT_RECORDER_ACTIVATE,
+				 output->output ? output->output->id : 0, app_id);
+
+	surf = ivi_find_app(ivi, app_id, output);
+	if (!surf) {
+		ivi_shell_activation_failed(ivi, app_id,
+					    AGL_SHELL_ACTIVATE_ERROR_UNKNOWN_APP_ID);
+		return;
+	}
+	ivi_debug(ivi, IVI_DEBUG_LAYOUT, "Found app_id %s\n", app_id);
+
+	ivi_layout_activate_surface(output, surf);
+}
+
+/* No strings involved, the handle is all it takes to find the surface */
+void
+ivi_layout_activate_handle(struct ivi_output *output, uint32_t handle)
+{
+	struct ivi_compositor *ivi = output->ivi;
+	struct ivi_surface *surf;
+
+	surf = ivi_find_handle(ivi, handle);
+	if (!surf) {
+		ivi_debug(ivi, IVI_DEBUG_LAYOUT, "unknown handle %u\n",
+			  handle);
+		ivi_shell_activation_failed(ivi, "",
+					    AGL_SHELL_ACTIVATE_ERROR_UNKNOWN_HANDLE);
+		return;
+	}
+
+	ivi_flight_record_app_id(FLIGHT_RECORDER_ACTIVATE,
+				 output->output ? output->output->id : 0,
+				 surf->app_id);
+
+	ivi_layout_activate_surface(output, surf);
+}
+
+/*
+ * Whatever was still on its way to become active on 'output' won't be, and
+ * is subject to the hidden-fps throttling from now on.
+ */
+static void
+ivi_layout_abandon_pending(struct ivi_output *output, struct ivi_surface *surf)
+{
+	struct ivi_surface *iter;
+
+	wl_list_for_each(iter, &output->ivi->surfaces, link) {
+		if (iter != surf && iter->desktop.pending_output == output) {
+			ivi_debug(output->ivi, IVI_DEBUG_LAYOUT,
+				  "activation of %s on output %s abandoned\n",
+				  iter->app_id ? iter->app_id : "no app_id",
+				  output->name);
+			iter->desktop.pending_output = NULL;
+		}
+	}
+}
+
+static void
+ivi_layout_activate_surface(struct ivi_output *output,
+			    struct ivi_surface *surf)
+{
+	struct ivi_compositor *ivi = output->ivi;
+	struct weston_desktop_surface *dsurf;
+	struct weston_view *view;
+	struct weston_geometry geom;
+
+	ivi_layout_abandon_pending(output, surf);
+
+	ivi_shell_activation_feedback(ivi, surf->app_id,
+				      IVI_ACTIVATION_ACCEPTED);
+
+	/* nothing to wait for */
+	if (surf == output->active) {
+		ivi_shell_activation_feedback(ivi, surf->app_id,
+					      IVI_ACTIVATION_CONFIGURED);
+		ivi_shell_activation_feedback(ivi, surf->app_id,
+					      IVI_ACTIVATION_PRESENTED);
+		return;
+	}
+
+	dsurf = surf->dsurface;
+	view = surf->view;
+	geom = weston_desktop_surface_get_geometry(dsurf);
+
+	if (weston_desktop_surface_get_maximized(dsurf) &&
+	    geom.width == output->area.width &&
+	    geom.height == output->area.height) {
+		ivi_layout_activate_complete(output, surf);
+		return;
+	}
+
+	weston_desktop_surface_set_maximized(dsurf, true);
+	weston_desktop_surface_set_size(dsurf,
+					output->area.width,
+					output->area.height);
+
+	/*
+	 * If the view isn't mapped, we put it onto the hidden layer so it will
+	 * start receiving frame events, and will be able to act on our
+	 * configure event.
+	 */
+	if (!weston_view_is_mapped(view)) {
+		view->is_mapped = true;
+		view->surface->is_mapped = true;
 
 		weston_view_set_output(view, output->output);
-		weston_layer_entry_insert(&ivi->hidden.view_list, &view->layer_link);
-		/* force repaint of the entire output */
-		weston_output_damage(output->output);
+		ivi_layer_insert(&ivi->hidden, view);
+		/*
+		 * Nothing visible changes, but the output needs to repaint for
+		 * the frame events to be sent.
+		 */
+		weston_output_schedule_repaint(output->output);
+	} else if (surf->hidden.parked) {
+		/* it needs frame events again to act on the configure */
+		weston_view_set_output(view, output->output);
+		ivi_layout_hidden_unpark(surf);
 	}
 
 	surf->desktop.pending_output = output;
 }
+
+/*
+ * Layout transactions
+ *
+ * agl_shell_transaction batches background, panel and activation changes,
+ * so that a homescreen changing its panels and the active app at once
+ * doesn't show each intermediate layout, with a repaint for every one of
+ * them. On commit the new backgrounds and panels get configured first, as
+ * the application area depends on the size they end up with. Once they
+ * committed buffers of the right size, the apps to activate, and the active
+ * ones in need of resizing for a new area, get configured to that area.
+ * Once these are ready as well, the whole layout changes within the same
+ * dispatch, hence in the same frame.
+ *
+ * libweston-desktop doesn't tell us about acked configures, so like for
+ * ivi_layout_activate() "ready" means the window geometry matches. Clients
+ * that don't get there within transaction-timeout in [shell] don't hold up
+ * the others for longer than that: the layout changes anyway, and the apps
+ * not ready yet complete their activation on their own.
+ *
+ * An active app being resized stays where it is until then, as libweston
+ * shows new buffers as soon as they are committed.
+ */
+
+enum ivi_layout_transaction_op_type {
+	IVI_LAYOUT_TRANSACTION_BACKGROUND,
+	IVI_LAYOUT_TRANSACTION_PANEL,
+	IVI_LAYOUT_TRANSACTION_ACTIVATE,
+	/* the active app, for a new application area */
+	IVI_LAYOUT_TRANSACTION_RESIZE,
+};
+
+struct ivi_layout_transaction_op {
+	struct wl_list link;	/* ivi_layout_transaction.ops */
+	enum ivi_layout_transaction_op_type type;
+	struct ivi_output *output;
+	/* for activations, only looked up on commit */
+	struct ivi_surface *surface;
+	enum agl_shell_edge edge;
+	char *app_id;
+
+	/* configure sent, 0 for the dimension left to panels */
+	bool configured;
+	int32_t width, height;
+};
+
+struct ivi_layout_transaction {
+	struct ivi_compositor *ivi;
+	struct wl_list ops;	/* ivi_layout_transaction_op.link */
+	bool committed;
+	/* waiting for the apps rather than the panels and backgrounds */
+	bool apps_configured;
+	struct wl_event_source *timer;
+	struct wl_event_source *idle;
+
+	void (*done)(void *data);
+	void *data;
+};
+
+static void
+ivi_layout_transaction_op_destroy(struct ivi_layout_transaction_op *op)
+{
+	if (op->surface)
+		op->surface->transaction = NULL;
+
+	wl_list_remove(&op->link);
+	free(op->app_id);
+	free(op);
+}
+
+static void
+ivi_layout_transaction_free(struct ivi_layout_transaction *transaction)
+{
+	struct ivi_layout_transaction_op *op, *tmp;
+
+	wl_list_for_each_safe(op, tmp, &transaction->ops, link)
+		ivi_layout_transaction_op_destroy(op);
+
+	if (transaction->timer)
+		wl_event_source_remove(transaction->timer);
+	if (transaction->idle)
+		wl_event_source_remove(transaction->idle);
+
+	free(transaction);
+}
+
+/* 'done' is called once the changes took effect, unless destroyed first */
+struct ivi_layout_transaction *
+ivi_layout_transaction_create(struct ivi_compositor *ivi,
+			      void (*done)(void *data), void *data)
+{
+	struct ivi_layout_transaction *transaction;
+
+	transaction = zalloc(sizeof(*transaction));
+	if (!transaction)
+		return NULL;
+
+	transaction->ivi = ivi;
+	wl_list_init(&transaction->ops);
+	transaction->done = done;
+	transaction->data = data;
+
+	return transaction;
+}
+
+/*
+ * A transaction not committed yet is discarded, a committed one goes ahead
+ * and frees itself once done, without calling 'done'.
+ */
+void
+ivi_layout_transaction_destroy(struct ivi_layout_transaction *transaction)
+{
+	if (transaction->committed) {
+		transaction->done = NULL;
+		return;
+	}
+
+	ivi_layout_transaction_free(transaction);
+}
+
+static struct ivi_layout_transaction_op *
+ivi_layout_transaction_find(struct ivi_layout_transaction *transaction,
+			    enum ivi_layout_transaction_op_type type,
+			    struct ivi_output *output, enum agl_shell_edge edge)
+{
+	struct ivi_layout_transaction_op *op;
+
+	wl_list_for_each(op, &transaction->ops, link) {
+		if (op->type == type && op->output == output &&
+		    (type != IVI_LAYOUT_TRANSACTION_PANEL || op->edge == edge))
+			return op;
+	}
+
+	return NULL;
+}
+
+/* Only the last change of the same thing counts */
+static struct ivi_layout_transaction_op *
+ivi_layout_transaction_add(struct ivi_layout_transaction *transaction,
+			   enum ivi_layout_transaction_op_type type,
+			   struct ivi_output *output, enum agl_shell_edge edge)
+{
+	struct ivi_layout_transaction_op *op;
+
+	op = ivi_layout_transaction_find(transaction, type, output, edge);
+	if (op)
+		ivi_layout_transaction_op_destroy(op);
+
+	op = zalloc(sizeof(*op));
+	if (!op)
+		return NULL;
+
+	op->type = type;
+	op->output = output;
+	op->edge = edge;
+	wl_list_insert(transaction->ops.prev, &op->link);
+
+	return op;
+}
+
+/* The surface must not be part of a transaction already */
+int
+ivi_layout_transaction_set_background(struct ivi_layout_transaction *transaction,
+				      struct ivi_output *output,
+				      struct ivi_surface *surface)
+{
+	struct ivi_layout_transaction_op *op;
+
+	op = ivi_layout_transaction_add(transaction,
+					IVI_LAYOUT_TRANSACTION_BACKGROUND,
+					output, 0);
+	if (!op)
+		return -1;
+
+	op->surface = surface;
+	surface->transaction = transaction;
+
+	return 0;
+}
+
+int
+ivi_layout_transaction_set_panel(struct ivi_layout_transaction *transaction,
+				 struct ivi_output *output,
+				 struct ivi_surface *surface,
+				 enum agl_shell_edge edge)
+{
+	struct ivi_layout_transaction_op *op;
+
+	op = ivi_layout_transaction_add(transaction,
+					IVI_LAYOUT_TRANSACTION_PANEL,
+					output, edge);
+	if (!op)
+		return -1;
+
+	op->surface = surface;
+	surface->transaction = transaction;
+
+	return 0;
+}
+
+int
+ivi_layout_transaction_activate(struct ivi_layout_transaction *transaction,
+				struct ivi_output *output, const char *app_id)
+{
+	struct ivi_layout_transaction_op *op;
+
+	op = ivi_layout_transaction_add(transaction,
+					IVI_LAYOUT_TRANSACTION_ACTIVATE,
+					output, 0);
+	if (!op)
+		return -1;
+
+	op->app_id = strdup(app_id);
+	if (!op->app_id) {
+		ivi_layout_transaction_op_destroy(op);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Makes a toplevel, or a surface without a role, ready to get a new one */
+static void
+ivi_layout_transaction_take(struct ivi_surface *surf)
+{
+	struct ivi_compositor *ivi = surf->ivi;
+	struct weston_view *view = surf->view;
+	struct ivi_output *output;
+
+	if (surf->role == IVI_SURFACE_ROLE_DESKTOP) {
+		/* in case it got activated since it was added */
+		wl_list_for_each(output, &ivi->outputs, link) {
+			if (output->active == surf) {
+				ivi_layout_damage_view(ivi, view);
+				output->active = NULL;
+			}
+		}
+
+		ivi_layout_hidden_reset(surf);
+		ivi_layout_standby_remove(surf);
+		ivi_layout_remove_app_id(surf);
+		surf->desktop.pending_output = NULL;
+		surf->desktop.last_output = NULL;
+	}
+
+	if (weston_view_is_mapped(view)) {
+		ivi_layer_remove(view);
+		view->is_mapped = false;
+		view->surface->is_mapped = false;
+	}
+
+	wl_list_remove(&surf->link);
+	wl_list_init(&surf->link);
+
+	ivi_surface_set_role(surf, IVI_SURFACE_ROLE_NONE);
+}
+
+/* A replaced background or panel becomes a regular toplevel */
+static void
+ivi_layout_transaction_release(struct ivi_surface *surf)
+{
+	struct ivi_compositor *ivi = surf->ivi;
+	struct weston_view *view = surf->view;
+
+	if (weston_view_is_mapped(view)) {
+		ivi_layer_remove(view);
+		view->is_mapped = false;
+		view->surface->is_mapped = false;
+	}
+
+	ivi_surface_set_role(surf, IVI_SURFACE_ROLE_NONE);
+
+	if (ivi->shell_client.ready)
+		ivi_set_desktop_surface(surf);
+	else
+		wl_list_insert(&ivi->pending_surfaces, &surf->link);
+}
+
+static void
+ivi_layout_transaction_configure(struct ivi_layout_transaction_op *op)
+{
+	struct ivi_surface *surf = op->surface;
+	struct ivi_compositor *ivi = surf->ivi;
+	struct weston_desktop_surface *dsurf = surf->dsurface;
+	struct weston_output *woutput = op->output->output;
+	struct weston_view *view = surf->view;
+
+	switch (op->type) {
+	case IVI_LAYOUT_TRANSACTION_BACKGROUND:
+		op->width = woutput->width;
+		op->height = woutput->height;
+		weston_desktop_surface_set_maximized(dsurf, true);
+		break;
+	case IVI_LAYOUT_TRANSACTION_PANEL:
+		/* see shell_set_panel() */
+		if (op->edge == AGL_SHELL_EDGE_TOP ||
+		    op->edge == AGL_SHELL_EDGE_BOTTOM)
+			op->width = woutput->width;
+		else
+			op->height = woutput->height;
+		break;
+	case IVI_LAYOUT_TRANSACTION_ACTIVATE:
+	case IVI_LAYOUT_TRANSACTION_RESIZE:
+		weston_desktop_surface_set_maximized(dsurf, true);
+		break;
+	}
+
+	weston_desktop_surface_set_size(dsurf, op->width, op->height);
+	op->configured = true;
+
+	/* before that ivi_layout_init() maps backgrounds and panels */
+	if (!ivi->shell_client.ready)
+		return;
+
+	/* frame events to act upon the configure, see ivi_layout_activate() */
+	if (!weston_view_is_mapped(view)) {
+		view->is_mapped = true;
+		view->surface->is_mapped = true;
+
+		weston_view_set_output(view, woutput);
+		ivi_layer_insert(&ivi->hidden, view);
+		weston_output_schedule_repaint(woutput);
+	} else if (surf->hidden.parked) {
+		weston_view_set_output(view, woutput);
+		ivi_layout_hidden_unpark(surf);
+	}
+}
+
+static struct ivi_surface **
+ivi_output_panel(struct ivi_output *output, enum agl_shell_edge edge)
+{
+	switch (edge) {
+	case AGL_SHELL_EDGE_TOP:
+		return &output->top;
+	case AGL_SHELL_EDGE_BOTTOM:
+		return &output->bottom;
+	case AGL_SHELL_EDGE_LEFT:
+		return &output->left;
+	case AGL_SHELL_EDGE_RIGHT:
+	default:
+		return &output->right;
+	}
+}
+
+/* What agl_shell.set_background and set_panel do, replacing what was there */
+static void
+ivi_layout_transaction_assign(struct ivi_layout_transaction_op *op)
+{
+	struct ivi_output *output = op->output;
+	struct ivi_surface *surf = op->surface;
+	struct ivi_surface **member;
+
+	if (op->type == IVI_LAYOUT_TRANSACTION_BACKGROUND)
+		member = &output->background;
+	else
+		member = ivi_output_panel(output, op->edge);
+
+	if (*member)
+		ivi_layout_transaction_release(*member);
+
+	if (op->type == IVI_LAYOUT_TRANSACTION_BACKGROUND) {
+		ivi_surface_set_role(surf, IVI_SURFACE_ROLE_BACKGROUND);
+		surf->bg.output = output;
+	} else {
+		ivi_surface_set_role(surf, IVI_SURFACE_ROLE_PANEL);
+		surf->panel.output = output;
+		surf->panel.edge = op->edge;
+	}
+
+	*member = surf;
+}
+
+static bool
+ivi_layout_transaction_op_ready(struct ivi_layout_transaction_op *op)
+{
+	struct weston_geometry geom;
+
+	if (!op->configured || !op->surface || !op->output->output)
+		return true;
+
+	geom = weston_desktop_surface_get_geometry(op->surface->dsurface);
+
+	/* panels pick one of their dimensions */
+	if (op->type == IVI_LAYOUT_TRANSACTION_PANEL && op->width)
+		return geom.width == op->width && geom.height > 0;
+	if (op->type == IVI_LAYOUT_TRANSACTION_PANEL)
+		return geom.height == op->height && geom.width > 0;
+
+	return geom.width == op->width && geom.height == op->height;
+}
+
+/*
+ * The application area of 'output' once the transaction is done, computed
+ * from the panels like ivi_panel_init() does, or the current one if the
+ * panels don't change.
+ */
+static void
+ivi_layout_transaction_area(struct ivi_layout_transaction *transaction,
+			    struct ivi_output *output,
+			    struct weston_geometry *area)
+{
+	struct ivi_surface *panels[] = {
+		[AGL_SHELL_EDGE_TOP] = output->top,
+		[AGL_SHELL_EDGE_BOTTOM] = output->bottom,
+		[AGL_SHELL_EDGE_LEFT] = output->left,
+		[AGL_SHELL_EDGE_RIGHT] = output->right,
+	};
+	struct ivi_layout_transaction_op *op;
+	bool changed = false;
+
+	wl_list_for_each(op, &transaction->ops, link) {
+		if (op->type == IVI_LAYOUT_TRANSACTION_PANEL &&
+		    op->output == output && op->surface &&
+		    op->edge < ARRAY_LENGTH(panels)) {
+			panels[op->edge] = op->surface;
+			changed = true;
+		}
+	}
+
+	*area = output->area;
+	if (!changed)
+		return;
+
+	area->x = 0;
+	area->y = 0;
+	area->width = output->output->width;
+	area->height = output->output->height;
+
+	for (size_t edge = 0; edge < ARRAY_LENGTH(panels); edge++) {
+		struct weston_geometry geom;
+
+		if (!panels[edge])
+			continue;
+
+		geom = weston_desktop_surface_get_geometry(panels[edge]->dsurface);
+		switch (edge) {
+		case AGL_SHELL_EDGE_TOP:
+			area->y += geom.height;
+			area->height -= geom.height;
+			break;
+		case AGL_SHELL_EDGE_BOTTOM:
+			area->height -= geom.height;
+			break;
+		case AGL_SHELL_EDGE_LEFT:
+			area->x += geom.width;
+			area->width -= geom.width;
+			break;
+		case AGL_SHELL_EDGE_RIGHT:
+			area->width -= geom.width;
+			break;
+		}
+	}
+}
+
+static void
+ivi_layout_transaction_configure_apps(struct ivi_layout_transaction *transaction)
+{
+	struct ivi_compositor *ivi = transaction->ivi;
+	struct ivi_layout_transaction_op *op;
+	struct ivi_output *output;
+
+	transaction->apps_configured = true;
+
+	wl_list_for_each(output, &ivi->outputs, link) {
+		struct weston_geometry area;
+		bool resized;
+
+		if (!output->output)
+			continue;
+
+		ivi_layout_transaction_area(transaction, output, &area);
+		resized = area.width != output->area.width ||
+			  area.height != output->area.height;
+
+		op = ivi_layout_transaction_find(transaction,
+						 IVI_LAYOUT_TRANSACTION_ACTIVATE,
+						 output, 0);
+		if (op && op->surface == output->active) {
+			ivi_layout_transaction_op_destroy(op);
+			op = NULL;
+		}
+
+		if (op) {
+			op->surface->desktop.pending_output = output;
+		} else if (resized && output->active &&
+			   !output->active->transaction) {
+			op = ivi_layout_transaction_add(transaction,
+							IVI_LAYOUT_TRANSACTION_RESIZE,
+							output, 0);
+			if (!op)
+				continue;
+
+			op->surface = output->active;
+			op->surface->transaction = transaction;
+		} else {
+			continue;
+		}
+
+		op->width = area.width;
+		op->height = area.height;
+		ivi_layout_transaction_configure(op);
+	}
+}
+
+static void
+ivi_layout_transaction_finish(struct ivi_layout_transaction *transaction)
+{
+	if (transaction->done)
+		transaction->done(transaction->data);
+
+	ivi_layout_transaction_free(transaction);
+}
+
+static void
+ivi_layout_transaction_apply_output(struct ivi_layout_transaction *transaction,
+				    struct ivi_output *output)
+{
+	struct ivi_compositor *ivi = transaction->ivi;
+	struct weston_output *woutput = output->output;
+	struct ivi_layout_transaction_op *op;
+	pixman_region32_t damage;
+	bool relayout = false;
+
+	wl_list_for_each(op, &transaction->ops, link) {
+		if (op->output != output || !op->surface ||
+		    (op->type != IVI_LAYOUT_TRANSACTION_BACKGROUND &&
+		     op->type != IVI_LAYOUT_TRANSACTION_PANEL))
+			continue;
+
+		ivi_layout_transaction_assign(op);
+		relayout = true;
+	}
+
+	/* everything on the output might move */
+	if (relayout) {
+		if (output->background)
+			ivi_layer_remove(output->background->view);
+		output->background_occluded = false;
+
+		ivi_layout_init(ivi, output);
+
+		pixman_region32_init_rect(&damage, woutput->x, woutput->y,
+					  woutput->width, woutput->height);
+		ivi_layout_damage_region(ivi, &damage);
+		pixman_region32_fini(&damage);
+	}
+
+	wl_list_for_each(op, &transaction->ops, link) {
+		if (op->output != output || !op->surface)
+			continue;
+
+		if (op->type == IVI_LAYOUT_TRANSACTION_RESIZE) {
+			weston_view_set_position(op->surface->view,
+						 woutput->x + output->area.x,
+						 woutput->y + output->area.y);
+		} else if (op->type == IVI_LAYOUT_TRANSACTION_ACTIVATE &&
+			   ivi_layout_transaction_op_ready(op)) {
+			ivi_layout_activate_complete(output, op->surface);
+		}
+	}
+
+	ivi_layout_update_occlusion(output);
+}
+
+/*
+ * Apps not ready yet still have their pending_output, and complete their
+ * activation through ivi_layout_desktop_committed() once the transaction
+ * is gone.
+ */
+static void
+ivi_layout_transaction_apply(struct ivi_layout_transaction *transaction)
+{
+	struct ivi_compositor *ivi = transaction->ivi;
+	struct ivi_layout_transaction_op *op, *tmp;
+	struct ivi_output *output;
+
+	ivi_debug(ivi, IVI_DEBUG_LAYOUT, "applying transaction %p\n",
+		  transaction);
+
+	/* outputs gone in the meantime */
+	wl_list_for_each_safe(op, tmp, &transaction->ops, link) {
+		if (op->output->output)
+			continue;
+
+		if (op->configured &&
+		    (op->type == IVI_LAYOUT_TRANSACTION_BACKGROUND ||
+		     op->type == IVI_LAYOUT_TRANSACTION_PANEL))
+			ivi_layout_transaction_release(op->surface);
+		ivi_layout_transaction_op_destroy(op);
+	}
+
+	wl_list_for_each(output, &ivi->outputs, link)
+		if (output->output)
+			ivi_layout_transaction_apply_output(transaction, output);
+
+	ivi_layout_transaction_finish(transaction);
+}
+
+static void
+ivi_layout_transaction_check(struct ivi_layout_transaction *transaction)
+{
+	struct ivi_layout_transaction_op *op;
+
+	wl_list_for_each(op, &transaction->ops, link)
+		if (!ivi_layout_transaction_op_ready(op))
+			return;
+
+	if (!transaction->apps_configured) {
+		ivi_layout_transaction_configure_apps(transaction);
+		/* e.g. apps preconfigured to the right size already */
+		ivi_layout_transaction_check(transaction);
+		return;
+	}
+
+	ivi_layout_transaction_apply(transaction);
+}
+
+static void
+ivi_layout_transaction_expire(struct ivi_layout_transaction *transaction)
+{
+	if (!transaction->apps_configured)
+		ivi_layout_transaction_configure_apps(transaction);
+
+	ivi_layout_transaction_apply(transaction);
+}
+
+static int
+ivi_layout_transaction_timeout(void *data)
+{
+	struct ivi_layout_transaction *transaction = data;
+	struct ivi_compositor *ivi = transaction->ivi;
+
+	ivi_loop_stats_enter(ivi, IVI_LOOP_SOURCE_TIMER);
+	weston_log("Layout transaction timed out waiting for clients\n");
+	ivi_layout_transaction_expire(transaction);
+	ivi_loop_stats_leave(ivi);
+
+	return 0;
+}
+
+static void
+ivi_layout_transaction_idle(void *data)
+{
+	struct ivi_layout_transaction *transaction = data;
+	struct ivi_compositor *ivi = transaction->ivi;
+
+	ivi_loop_stats_enter(ivi, IVI_LOOP_SOURCE_IDLE);
+	transaction->idle = NULL;
+	ivi_layout_transaction_check(transaction);
+	ivi_loop_stats_leave(ivi);
+}
+
+void
+ivi_layout_transaction_commit(struct ivi_layout_transaction *transaction)
+{
+	struct ivi_compositor *ivi = transaction->ivi;
+	struct wl_event_loop *loop =
+		wl_display_get_event_loop(ivi->compositor->wl_display);
+	struct ivi_layout_transaction_op *op, *tmp;
+	struct ivi_surface *surf;
+
+	transaction->committed = true;
+
+	wl_list_for_each_safe(op, tmp, &transaction->ops, link) {
+		if (!op->output->output) {
+			ivi_layout_transaction_op_destroy(op);
+			continue;
+		}
+
+		switch (op->type) {
+		case IVI_LAYOUT_TRANSACTION_BACKGROUND:
+		case IVI_LAYOUT_TRANSACTION_PANEL:
+			ivi_layout_transaction_take(op->surface);
+			ivi_layout_transaction_configure(op);
+			/* nothing is shown yet, ivi_layout_init() takes over */
+			if (!ivi->shell_client.ready)
+				ivi_layout_transaction_assign(op);
+			break;
+		case IVI_LAYOUT_TRANSACTION_ACTIVATE:
+			if (!ivi->shell_client.ready) {
+				ivi_layout_activate(op->output, op->app_id);
+				break;
+			}
+
+			surf = ivi_find_app(ivi, op->app_id, op->output);
+			if (!surf || surf->transaction) {
+				ivi_debug(ivi, IVI_DEBUG_LAYOUT,
+					  "transaction can't activate %s\n",
+					  op->app_id);
+				ivi_layout_transaction_op_destroy(op);
+				break;
+			}
+
+			op->surface = surf;
+			surf->transaction = transaction;
+			break;
+		case IVI_LAYOUT_TRANSACTION_RESIZE:
+			break;
+		}
+	}
+
+	if (!ivi->shell_client.ready) {
+		ivi_layout_transaction_finish(transaction);
+		return;
+	}
+
+	transaction->timer =
+		wl_event_loop_add_timer(loop, ivi_layout_transaction_timeout,
+					transaction);
+	if (!transaction->timer) {
+		ivi_layout_transaction_expire(transaction);
+		return;
+	}
+	wl_event_source_timer_update(transaction->timer,
+				     MAX(ivi->transaction_timeout, 1));
+
+	ivi_layout_transaction_check(transaction);
+}
+
+/*
+ * Returns true when the surface is part of a committed transaction, which
+ * takes care of it instead of the usual commit handling.
+ */
+bool
+ivi_layout_transaction_surface_committed(struct ivi_surface *surf)
+{
+	struct ivi_layout_transaction *transaction = surf->transaction;
+
+	if (!transaction || !transaction->committed)
+		return false;
+
+	ivi_layout_transaction_check(transaction);
+
+	return true;
+}
+
+/*
+ * The others might have been waiting for this one only. Not checked on the
+ * spot, as the surface is still half there.
+ */
+void
+ivi_layout_transaction_surface_removed(struct ivi_surface *surf)
+{
+	struct ivi_layout_transaction *transaction = surf->transaction;
+	struct wl_event_loop *loop;
+	struct ivi_layout_transaction_op *op, *tmp;
+
+	if (!transaction)
+		return;
+
+	wl_list_for_each_safe(op, tmp, &transaction->ops, link)
+		if (op->surface == surf)
+			ivi_layout_transaction_op_destroy(op);
+
+	if (!transaction->committed || transaction->idle)
+		return;
+
+	loop = wl_display_get_event_loop(surf->ivi->compositor->wl_display);
+	transaction->idle = wl_event_loop_add_idle(loop,
+						   ivi_layout_transaction_idle,
+						   transaction);
+}
@@ -0,0 +1,347 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "ivi-compositor.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Writes the "[HH:MM:SS.mmm] " prefix of a log line, plus a "Date:" line
+ * whenever the day changes. localtime_r() and strftime() only run once a
+ * second, the rest of the time the formatted time is reused.
+ */
+int
+ivi_log_timestamp(FILE *file, const struct timespec *ts)
+{
+	static int cached_tm_mday = -1;
+	static time_t cached_sec = -1;
+	static char cached_time[16];
+	struct tm brokendown_time;
+	char buf[128];
+
+	if (ts->tv_sec != cached_sec) {
+		if (!localtime_r(&ts->tv_sec, &brokendown_time))
+			return fprintf(file, "[(NULL)localtime] ");
+
+		if (brokendown_time.tm_mday != cached_tm_mday) {
+			strftime(buf, sizeof buf, "%Y-%m-%d %Z", &brokendown_time);
+			fprintf(file, "Date: %s\n", buf);
+
+			cached_tm_mday = brokendown_time.tm_mday;
+		}
+
+		strftime(cached_time, sizeof cached_time, "%H:%M:%S",
+			 &brokendown_time);
+		cached_sec = ts->tv_sec;
+	}
+
+	return fprintf(file, "[%s.%03ld] ", cached_time, ts->tv_nsec / 1000000);
+}
+
+/*
+ * Asynchronous log writer
+ *
+ * The main thread formats the messages into a single producer, single
+ * consumer ring buffer, and a writer thread writes them out to the log file
+ * in batches, so logging never blocks the main loop on I/O. When the ring is
+ * full messages are dropped and counted, rather than waiting on the writer.
+ *
+ * Records are 8-byte aligned and never wrap around: when one doesn't fit in
+ * the space left at the end of the ring, a record with no text marks the rest
+ * as padding and it goes at the start instead.
+ */
+
+#define LOG_RING_SIZE		(256 * 1024)
+#define LOG_LINE_MAX		512
+#define LOG_RECORD_ALIGN(n)	(((n) + 7) & ~(size_t) 7)
+
+enum log_record_flags {
+	LOG_RECORD_TIMESTAMP = 1 << 0,	/* not a continuation */
+	LOG_RECORD_PADDING = 1 << 1,
+};
+
+struct log_record {
+	uint32_t size;		/* header included, aligned */
+	uint32_t flags;
+	struct timespec ts;
+	uint32_t len;
+	char text[];
+};
+
+struct log_async {
+	FILE *file;
+	pthread_t thread;
+	int wake_fd;
+	bool running;
+	bool sleeping;
+
+	uint64_t dropped;
+	uint64_t dropped_reported;
+
+	/* free running, the index in the ring is modulo LOG_RING_SIZE */
+	uint64_t head;		/* written by the main thread */
+	uint64_t tail;		/* written by the writer thread */
+	char ring[LOG_RING_SIZE] __attribute__((aligned(8)));
+};
+
+static struct log_async *log_async;
+
+static void
+log_async_wake(struct log_async *log)
+{
+	uint64_t one = 1;
+
+	if (!__atomic_exchange_n(&log->sleeping, false, __ATOMIC_SEQ_CST))
+		return;
+
+	if (write(log->wake_fd, &one, sizeof one) < 0) {
+		/* it will wake up with the next message */
+	}
+}
+
+/*
+ * Returns room for a record of 'size' bytes, or NULL if the ring is full. The
+ * record is only seen by the writer once published with log_async_commit().
+ */
+static struct log_record *
+log_async_reserve(struct log_async *log, size_t size)
+{
+	uint64_t head = log->head;
+	uint64_t tail = __atomic_load_n(&log->tail, __ATOMIC_ACQUIRE);
+	size_t offset = head % LOG_RING_SIZE;
+	size_t to_end = LOG_RING_SIZE - offset;
+	size_t needed = size;
+
+	if (to_end < size)
+		needed += to_end;
+
+	if (LOG_RING_SIZE - (head - tail) < needed)
+		return NULL;
+
+	if (to_end < size) {
+		struct log_record *padding = (void *) &log->ring[offset];
+
+		/* size and flags always fit, records are aligned */
+		padding->size = to_end;
+		padding->flags = LOG_RECORD_PADDING;
+		/* published on its own, the writer may skip it right away */
+		__atomic_store_n(&log->head, head + to_end, __ATOMIC_RELEASE);
+		offset = 0;
+	}
+
+	return (void *) &log->ring[offset];
+}
+
+static void
+log_async_commit(struct log_async *log, struct log_record *record)
+{
+	/* ordered with the check of 'sleeping' in log_async_wake() */
+	__atomic_store_n(&log->head, log->head + record->size, __ATOMIC_SEQ_CST);
+	log_async_wake(log);
+}
+
+int
+ivi_log_async_vprintf(bool timestamp, const char *fmt, va_list ap)
+{
+	struct log_async *log = log_async;
+	struct log_record *record;
+	char line[LOG_LINE_MAX];
+	va_list aq;
+	int len;
+
+	va_copy(aq, ap);
+	len = vsnprintf(line, sizeof line, fmt, aq);
+	va_end(aq);
+	if (len < 0)
+		return len;
+
+	record = log_async_reserve(log, LOG_RECORD_ALIGN(sizeof(*record) +
+							 len + 1));
+	if (!record) {
+		__atomic_add_fetch(&log->dropped, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	record->size = LOG_RECORD_ALIGN(sizeof(*record) + len + 1);
+	record->flags = timestamp ? LOG_RECORD_TIMESTAMP : 0;
+	record->len = len;
+	if (timestamp)
+		clock_gettime(CLOCK_REALTIME, &record->ts);
+
+	if ((size_t) len < sizeof line)
+		memcpy(record->text, line, len + 1);
+	else
+		vsnprintf(record->text, len + 1, fmt, ap);
+
+	log_async_commit(log, record);
+
+	return len;
+}
+
+/* Writes out what's in the ring, returns false if there was nothing */
+static bool
+log_async_drain(struct log_async *log)
+{
+	uint64_t head = __atomic_load_n(&log->head, __ATOMIC_ACQUIRE);
+	uint64_t tail = log->tail;
+	uint64_t dropped;
+
+	if (head == tail)
+		return false;
+
+	while (tail != head) {
+		struct log_record *record =
+			(void *) &log->ring[tail % LOG_RING_SIZE];
+
+		if (!(record->flags & LOG_RECORD_PADDING)) {
+			if (record->flags & LOG_RECORD_TIMESTAMP)
+				ivi_log_timestamp(log->file, &record->ts);
+			fwrite(record->text, 1, record->len, log->file);
+		}
+
+		tail += record->size;
+	}
+
+	__atomic_store_n(&log->tail, tail, __ATOMIC_RELEASE);
+
+	dropped = __atomic_load_n(&log->dropped, __ATOMIC_RELAXED);
+	if (dropped != log->dropped_reported) {
+		struct timespec ts;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ivi_log_timestamp(log->file, &ts);
+		fprintf(log->file, "%" PRIu64 " log messages dropped\n",
+			dropped - log->dropped_reported);
+		log->dropped_reported = dropped;
+	}
+
+	fflush(log->file);
+
+	return true;
+}
+
+static void *
+log_async_thread(void *data)
+{
+	struct log_async *log = data;
+	uint64_t count;
+
+	while (__atomic_load_n(&log->running, __ATOMIC_ACQUIRE)) {
+		if (log_async_drain(log))
+			continue;
+
+		/*
+		 * Tell the main thread to wake us up, then check again in
+		 * case a message came in meanwhile.
+		 */
+		__atomic_store_n(&log->sleeping, true, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&log->head, __ATOMIC_SEQ_CST) != log->tail) {
+			__atomic_store_n(&log->sleeping, false,
+					 __ATOMIC_SEQ_CST);
+			continue;
+		}
+
+		if (read(log->wake_fd, &count, sizeof count) < 0 &&
+		    errno != EINTR)
+			break;
+	}
+
+	log_async_drain(log);
+
+	return NULL;
+}
+
+int
+ivi_log_async_start(FILE *file)
+{
+	struct log_async *log;
+	sigset_t set, old;
+	int ret;
+
+	log = zalloc(sizeof(*log));
+	if (!log)
+		return -1;
+
+	log->file = file;
+	log->running = true;
+	log->wake_fd = eventfd(0, EFD_CLOEXEC);
+	if (log->wake_fd < 0) {
+		free(log);
+		return -1;
+	}
+
+	/* batches are flushed by hand */
+	setvbuf(file, NULL, _IOFBF, 64 * 1024);
+
+	/* signals are for the main loop */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	ret = pthread_create(&log->thread, NULL, log_async_thread, log);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (ret != 0) {
+		close(log->wake_fd);
+		free(log);
+		errno = ret;
+		return -1;
+	}
+
+	log_async = log;
+
+	return 0;
+}
+
+/* Writes out what's left and stops the writer thread */
+void
+ivi_log_async_stop(void)
+{
+	struct log_async *log = log_async;
+	uint64_t one = 1;
+
+	if (!log)
+		return;
+
+	__atomic_store_n(&log->running, false, __ATOMIC_RELEASE);
+	if (write(log->wake_fd, &one, sizeof one) < 0) {
+		/* the thread is stuck in a write; join it anyway */
+	}
+
+	pthread_join(log->thread, NULL);
+	close(log->wake_fd);
+	free(log);
+
+	log_async = NULL;
+}
@@ -0,0 +1,614 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Event loop statistics
+ *
+ * Enabled with loop-stats=true in [core]. The main loop is then run by
+ * ivi_loop_stats_run() rather than wl_display_run(), which waits on the event
+ * loop fd itself so that the time spent dispatching each iteration is known
+ * apart from the time spent sleeping. Any event arriving while an iteration
+ * is dispatched waits that long, so this is the loop lag.
+ *
+ * Within an iteration, time is attributed to whoever is running:
+ *
+ * - client requests, from the protocol logger, which libwayland calls right
+ *   before dispatching each request. A request is accounted until the next
+ *   request, the next compositor handler, or the end of the iteration,
+ *   whichever comes first, so its time can include libweston work done
+ *   later in the same iteration;
+ * - the compositor's own timer, signal, fd and idle handlers, which call
+ *   ivi_loop_stats_enter() and ivi_loop_stats_leave();
+ * - everything else, that is libweston's own sources: repaints, input,
+ *   backend events.
+ *
+ * Durations go into log-linear histograms, in microseconds, one per kind of
+ * source and one per client. SIGUSR1 writes them into the log, and
+ * connecting to the loop-stats-socket in [core], agl-compositor-loop-stats in
+ * XDG_RUNTIME_DIR by default, reads them. Without either, there is no
+ * socket.
+ */
+
+#include "ivi-compositor.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libweston-6/config-parser.h>
+
+#include "shared/helpers.h"
+#include "shared/os-compatibility.h"
+#include "shared/timespec-util.h"
+
+/*
+ * Values below 8 us get a bucket each, then every power of two is split in
+ * 8 buckets, which keeps the error under 12.5%, up to 2^32 us.
+ */
+#define HISTOGRAM_SUB_BITS	3
+#define HISTOGRAM_SUB		(1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS	((32 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB)
+
+struct histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint32_t buckets[HISTOGRAM_BUCKETS];
+};
+
+struct loop_client {
+	struct ivi_loop_stats *stats;
+	struct wl_list link;	/* ivi_loop_stats.clients */
+	struct wl_listener destroy;
+	pid_t pid;
+	char comm[16];
+	struct histogram requests;
+	char worst[64];		/* slowest request */
+};
+
+struct ivi_loop_stats {
+	struct ivi_compositor *ivi;
+	bool running;
+	bool dispatching;	/* an iteration is being accounted for */
+	struct timespec since;
+
+	struct histogram iteration;
+	struct histogram sources[IVI_LOOP_SOURCE_IDLE + 1];
+
+	struct wl_list clients;	/* loop_client.link */
+	struct histogram gone;	/* requests of destroyed clients */
+
+	/* what is being accounted for in the current iteration */
+	enum ivi_loop_source current;
+	struct loop_client *current_client;
+	char current_request[64];
+	struct timespec current_start;
+	uint64_t attributed;	/* us, this iteration */
+
+	struct wl_protocol_logger *logger;
+
+	char *socket_path;
+	int socket_fd;
+	struct wl_event_source *socket_source;
+};
+
+static const char * const source_names[] = {
+	[IVI_LOOP_SOURCE_OTHER] = "other",
+	[IVI_LOOP_SOURCE_CLIENT] = "client",
+	[IVI_LOOP_SOURCE_TIMER] = "timer",
+	[IVI_LOOP_SOURCE_SIGNAL] = "signal",
+	[IVI_LOOP_SOURCE_FD] = "fd",
+	[IVI_LOOP_SOURCE_IDLE] = "idle",
+};
+
+static unsigned int
+histogram_bucket(uint64_t value)
+{
+	unsigned int msb;
+
+	if (value < HISTOGRAM_SUB)
+		return value;
+
+	msb = 63 - __builtin_clzll(value);
+	if (msb >= 32)
+		return HISTOGRAM_BUCKETS - 1;
+
+	return (msb - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB +
+	       ((value >> (msb - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB - 1));
+}
+
+/* Smallest value going into 'bucket' */
+static uint64_t
+histogram_bucket_start(unsigned int bucket)
+{
+	unsigned int msb, sub;
+
+	if (bucket < HISTOGRAM_SUB)
+		return bucket;
+
+	msb = bucket / HISTOGRAM_SUB + HISTOGRAM_SUB_BITS - 1;
+	sub = bucket % HISTOGRAM_SUB;
+
+	return (uint64_t) (HISTOGRAM_SUB + sub) << (msb - HISTOGRAM_SUB_BITS);
+}
+
+static void
+histogram_add(struct histogram *h, uint64_t value)
+{
+	h->count++;
+	h->sum += value;
+	if (value > h->max)
+		h->max = value;
+	h->buckets[histogram_bucket(value)]++;
+}
+
+static void
+histogram_merge(struct histogram *h, const struct histogram *other)
+{
+	h->count += other->count;
+	h->sum += other->sum;
+	if (other->max > h->max)
+		h->max = other->max;
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		h->buckets[i] += other->buckets[i];
+}
+
+/* Upper bound of the value at 'percent', within the bucket resolution */
+static uint64_t
+histogram_percentile(const struct histogram *h, unsigned int percent)
+{
+	uint64_t rank = (h->count * percent + 99) / 100;
+	uint64_t seen = 0;
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS - 1; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank && seen > 0) {
+			uint64_t end = histogram_bucket_start(i + 1) - 1;
+
+			return end < h->max ? end : h->max;
+		}
+	}
+
+	return h->max;
+}
+
+static void
+histogram_print(FILE *file, const char *name, const struct histogram *h)
+{
+	fprintf(file, "  %-24s %10" PRIu64 " %8" PRIu64 " %8" PRIu64
+		" %8" PRIu64 " %8" PRIu64 " %10" PRIu64 "\n",
+		name, h->count, histogram_percentile(h, 50),
+		histogram_percentile(h, 90), histogram_percentile(h, 99),
+		h->max, h->sum / 1000);
+}
+
+static void
+loop_stats_print(struct ivi_loop_stats *stats, FILE *file)
+{
+	struct loop_client *client;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	fprintf(file, "Event loop dispatch times over the last %" PRId64
+		" s, in us:\n", timespec_sub_to_msec(&now, &stats->since) / 1000);
+	fprintf(file, "  %-24s %10s %8s %8s %8s %8s %10s\n", "",
+		"count", "p50", "p90", "p99", "max", "total ms");
+
+	histogram_print(file, "iteration", &stats->iteration);
+	for (size_t i = 0; i < ARRAY_LENGTH(source_names); i++)
+		histogram_print(file, source_names[i], &stats->sources[i]);
+
+	fprintf(file, "Client requests, in us:\n");
+	wl_list_for_each(client, &stats->clients, link) {
+		char name[64];
+
+		snprintf(name, sizeof(name), "%d %s", client->pid,
+			 client->comm);
+		histogram_print(file, name, &client->requests);
+		if (client->worst[0])
+			fprintf(file, "  %-24s slowest: %s\n", "",
+				client->worst);
+	}
+	histogram_print(file, "(destroyed clients)", &stats->gone);
+}
+
+void
+ivi_loop_stats_dump(struct ivi_compositor *ivi)
+{
+	char *buf = NULL;
+	size_t size = 0;
+	FILE *file;
+
+	if (!ivi->loop_stats)
+		return;
+
+	file = open_memstream(&buf, &size);
+	if (!file)
+		return;
+
+	loop_stats_print(ivi->loop_stats, file);
+	fclose(file);
+
+	weston_log("%s", buf);
+	free(buf);
+}
+
+static uint64_t
+loop_stats_elapsed(struct ivi_loop_stats *stats, struct timespec *now)
+{
+	clock_gettime(CLOCK_MONOTONIC, now);
+
+	return timespec_sub_to_nsec(now, &stats->current_start) / 1000;
+}
+
+/* Closes the current attribution, and starts accounting for 'source' */
+static void
+loop_stats_switch(struct ivi_loop_stats *stats, enum ivi_loop_source source,
+		  struct loop_client *client)
+{
+	struct timespec now;
+	uint64_t usec = loop_stats_elapsed(stats, &now);
+
+	if (stats->current != IVI_LOOP_SOURCE_OTHER) {
+		histogram_add(&stats->sources[stats->current], usec);
+		stats->attributed += usec;
+	}
+
+	if (stats->current_client) {
+		struct loop_client *c = stats->current_client;
+
+		if (usec > c->requests.max)
+			snprintf(c->worst, sizeof(c->worst), "%s, %" PRIu64
+				 " us", stats->current_request, usec);
+		histogram_add(&c->requests, usec);
+	}
+
+	stats->current = source;
+	stats->current_client = client;
+	stats->current_start = now;
+}
+
+void
+ivi_loop_stats_enter(struct ivi_compositor *ivi, enum ivi_loop_source source)
+{
+	if (ivi->loop_stats && ivi->loop_stats->dispatching)
+		loop_stats_switch(ivi->loop_stats, source, NULL);
+}
+
+void
+ivi_loop_stats_leave(struct ivi_compositor *ivi)
+{
+	if (ivi->loop_stats && ivi->loop_stats->dispatching)
+		loop_stats_switch(ivi->loop_stats, IVI_LOOP_SOURCE_OTHER, NULL);
+}
+
+static void
+loop_client_destroy(struct wl_listener *listener, void *data)
+{
+	struct loop_client *client =
+		wl_container_of(listener, client, destroy);
+	struct ivi_loop_stats *stats = client->stats;
+
+	if (stats->current_client == client) {
+		if (stats->dispatching)
+			loop_stats_switch(stats, IVI_LOOP_SOURCE_OTHER, NULL);
+		stats->current_client = NULL;
+	}
+
+	histogram_merge(&stats->gone, &client->requests);
+
+	wl_list_remove(&client->link);
+	wl_list_remove(&client->destroy.link);
+	free(client);
+}
+
+static struct loop_client *
+loop_client_get(struct ivi_loop_stats *stats, struct wl_client *wl_client)
+{
+	struct loop_client *client;
+	struct wl_listener *listener;
+	char path[64];
+	FILE *file;
+
+	listener = wl_client_get_destroy_listener(wl_client,
+						  loop_client_destroy);
+	if (listener)
+		return wl_container_of(listener, client, destroy);
+
+	client = zalloc(sizeof(*client));
+	if (!client)
+		return NULL;
+
+	client->stats = stats;
+	wl_client_get_credentials(wl_client, &client->pid, NULL, NULL);
+
+	snprintf(path, sizeof(path), "/proc/%d/comm", client->pid);
+	file = fopen(path, "re");
+	if (file) {
+		if (fgets(client->comm, sizeof(client->comm), file))
+			client->comm[strcspn(client->comm, "\n")] = '\0';
+		fclose(file);
+	}
+
+	client->destroy.notify = loop_client_destroy;
+	wl_client_add_destroy_listener(wl_client, &client->destroy);
+	wl_list_insert(stats->clients.prev, &client->link);
+
+	return client;
+}
+
+static void
+loop_stats_protocol(void *user_data, enum wl_protocol_logger_type direction,
+		    const struct wl_protocol_logger_message *message)
+{
+	struct ivi_loop_stats *stats = user_data;
+	struct loop_client *client;
+
+	/* events are sent from within whatever is running */
+	if (direction != WL_PROTOCOL_LOGGER_REQUEST || !stats->dispatching)
+		return;
+
+	client = loop_client_get(stats,
+				 wl_resource_get_client(message->resource));
+	loop_stats_switch(stats, IVI_LOOP_SOURCE_CLIENT, client);
+
+	snprintf(stats->current_request, sizeof(stats->current_request),
+		 "%s.%s", wl_resource_get_class(message->resource),
+		 message->message->name);
+}
+
+static int
+loop_stats_socket_data(int fd, uint32_t mask, void *data)
+{
+	struct ivi_loop_stats *stats = data;
+	char *buf = NULL;
+	size_t size = 0;
+	FILE *file;
+	int client_fd;
+
+	ivi_loop_stats_enter(stats->ivi, IVI_LOOP_SOURCE_FD);
+
+	client_fd = accept4(fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (client_fd < 0)
+		goto out;
+
+	file = open_memstream(&buf, &size);
+	if (file) {
+		loop_stats_print(stats, file);
+		fclose(file);
+
+		/*
+		 * The socket buffer easily holds all of it, and a reader that
+		 * doesn't keep up gets a truncated dump rather than blocking
+		 * the compositor.
+		 */
+		if (write(client_fd, buf, size) < 0)
+			weston_log("Failed to send the loop stats: %s\n",
+				   strerror(errno));
+		free(buf);
+	}
+
+	close(client_fd);
+
+out:
+	ivi_loop_stats_leave(stats->ivi);
+	return 0;
+}
+
+static int
+loop_stats_socket_init(struct ivi_loop_stats *stats)
+{
+	struct weston_config_section *section;
+	struct wl_event_loop *loop;
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	const char *dir;
+
+	section = weston_config_get_section(stats->ivi->config, "core",
+					    NULL, NULL);
+	weston_config_section_get_string(section, "loop-stats-socket",
+					 &stats->socket_path, NULL);
+	if (!stats->socket_path) {
+		/* it gets unlinked first, no fixed name in /tmp for that */
+		dir = getenv("XDG_RUNTIME_DIR");
+		if (!dir)
+			return -1;
+
+		if (asprintf(&stats->socket_path,
+			     "%s/agl-compositor-loop-stats", dir) < 0) {
+			stats->socket_path = NULL;
+			return -1;
+		}
+	}
+
+	if (strlen(stats->socket_path) >= sizeof(addr.sun_path)) {
+		weston_log("Loop stats socket path %s is too long\n",
+			   stats->socket_path);
+		return -1;
+	}
+	strcpy(addr.sun_path, stats->socket_path);
+
+	stats->socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (stats->socket_fd < 0)
+		return -1;
+
+	unlink(stats->socket_path);
+	if (bind(stats->socket_fd, (struct sockaddr *) &addr,
+		 sizeof(addr)) < 0 ||
+	    chmod(stats->socket_path, 0600) < 0 ||
+	    listen(stats->socket_fd, 4) < 0) {
+		weston_log("Failed to set up the loop stats socket %s: %s\n",
+			   stats->socket_path, strerror(errno));
+		return -1;
+	}
+
+	loop = wl_display_get_event_loop(stats->ivi->compositor->wl_display);
+	stats->socket_source =
+		wl_event_loop_add_fd(loop, stats->socket_fd, WL_EVENT_READABLE,
+				     loop_stats_socket_data, stats);
+	if (!stats->socket_source)
+		return -1;
+
+	weston_log("Loop stats available on %s\n", stats->socket_path);
+
+	return 0;
+}
+
+int
+ivi_loop_stats_init(struct ivi_compositor *ivi)
+{
+	struct weston_config_section *section;
+	struct ivi_loop_stats *stats;
+	int enabled;
+
+	section = weston_config_get_section(ivi->config, "core", NULL, NULL);
+	weston_config_section_get_bool(section, "loop-stats", &enabled, 0);
+	if (!enabled)
+		return 0;
+
+	stats = zalloc(sizeof(*stats));
+	if (!stats)
+		return -1;
+
+	stats->ivi = ivi;
+	stats->socket_fd = -1;
+	wl_list_init(&stats->clients);
+	clock_gettime(CLOCK_MONOTONIC, &stats->since);
+
+	stats->logger =
+		wl_display_add_protocol_logger(ivi->compositor->wl_display,
+					       loop_stats_protocol, stats);
+	if (!stats->logger) {
+		free(stats);
+		return -1;
+	}
+
+	ivi->loop_stats = stats;
+
+	/* the statistics are still useful without the socket */
+	loop_stats_socket_init(stats);
+
+	return 0;
+}
+
+void
+ivi_loop_stats_destroy(struct ivi_compositor *ivi)
+{
+	struct ivi_loop_stats *stats = ivi->loop_stats;
+	struct loop_client *client, *tmp;
+
+	if (!stats)
+		return;
+
+	ivi->loop_stats = NULL;
+
+	wl_list_for_each_safe(client, tmp, &stats->clients, link) {
+		wl_list_remove(&client->link);
+		wl_list_remove(&client->destroy.link);
+		free(client);
+	}
+
+	if (stats->socket_source)
+		wl_event_source_remove(stats->socket_source);
+	if (stats->socket_fd >= 0) {
+		close(stats->socket_fd);
+		unlink(stats->socket_path);
+	}
+	free(stats->socket_path);
+
+	wl_protocol_logger_destroy(stats->logger);
+	free(stats);
+}
+
+/* Same as wl_display_run(), with each iteration accounted for */
+void
+ivi_loop_stats_run(struct ivi_compositor *ivi)
+{
+	struct ivi_loop_stats *stats = ivi->loop_stats;
+	struct wl_display *display = ivi->compositor->wl_display;
+	struct wl_event_loop *loop = wl_display_get_event_loop(display);
+	struct pollfd pfd = {
+		.fd = wl_event_loop_get_fd(loop),
+		.events = POLLIN,
+	};
+	struct timespec start, end;
+	uint64_t usec;
+
+	stats->running = true;
+
+	while (stats->running) {
+		/*
+		 * Idle sources queued from outside of a dispatch, which
+		 * wl_event_loop_dispatch() would run before waiting. Those
+		 * queued during a dispatch run at its end.
+		 */
+		wl_event_loop_dispatch_idle(loop);
+		wl_display_flush_clients(display);
+
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+			weston_log("Failed to wait on the event loop: %s\n",
+				   strerror(errno));
+			break;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		stats->current_start = start;
+		stats->current = IVI_LOOP_SOURCE_OTHER;
+		stats->attributed = 0;
+		stats->dispatching = true;
+
+		wl_event_loop_dispatch(loop, 0);
+
+		/* closes whatever was still accounted for */
+		loop_stats_switch(stats, IVI_LOOP_SOURCE_OTHER, NULL);
+		stats->dispatching = false;
+		end = stats->current_start;
+
+		usec = timespec_sub_to_nsec(&end, &start) / 1000;
+		histogram_add(&stats->iteration, usec);
+		if (usec > stats->attributed)
+			histogram_add(&stats->sources[IVI_LOOP_SOURCE_OTHER],
+				      usec - stats->attributed);
+	}
+
+	stats->running = false;
+}
+
+/* Makes ivi_loop_stats_run() return, after wl_display_terminate() */
+void
+ivi_loop_stats_stop(struct ivi_compositor *ivi)
+{
+	if (ivi->loop_stats)
+		ivi->loop_stats->running = false;
+}
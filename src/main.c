@@ -27,6 +27,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -37,12 +38,14 @@
 #include <linux/input.h>
 
 #include <libweston-6/compositor-drm.h>
+#include <libweston-6/compositor-headless.h>
 #include <libweston-6/compositor-wayland.h>
 #include <libweston-6/compositor-x11.h>
 #include <libweston-6/compositor.h>
 #include <libweston-6/windowed-output-api.h>
 #include <libweston-6/config-parser.h>
 
+#include "shared/flight-recorder.h"
 #include "shared/os-compatibility.h"
 
 #include "agl-shell-server-protocol.h"
@@ -61,8 +64,56 @@ handle_output_destroy(struct wl_listener *listener, void *data)
 	output = wl_container_of(listener, output, output_destroy);
 	assert(output->output == data);
 
+	ivi_flight_record(FLIGHT_RECORDER_OUTPUT_REMOVED, output->output->id, 0);
+
+	weston_log("Output %s: %" PRIu64 " commit repaints, %" PRIu64
+		   " avoided, %" PRIu64 " pixels damaged, %" PRIu64
+		   " activations superseded\n", output->name,
+		   output->commit_repaint.scheduled,
+		   output->commit_repaint.avoided, output->damage.total,
+		   output->queued_activation.dropped);
+
+	ivi_metrics_output_destroyed(output);
+
+	free(output->presented_app_id);
+	output->presented_app_id = NULL;
+
 	output->output = NULL;
 	wl_list_remove(&output->output_destroy.link);
+	wl_list_remove(&output->output_frame.link);
+}
+
+static void
+handle_output_frame(struct wl_listener *listener, void *data)
+{
+	struct ivi_output *output;
+
+	output = wl_container_of(listener, output, output_frame);
+
+	output->damage.last_frame = output->damage.pending;
+	output->damage.pending = 0;
+
+	output->frames.count++;
+	clock_gettime(CLOCK_MONOTONIC, &output->frames.last);
+
+	ivi_flight_record(FLIGHT_RECORDER_REPAINT, output->output->id,
+			  output->damage.last_frame);
+
+	ivi_debug(output->ivi, IVI_DEBUG_OUTPUT,
+		  "output %s repainted, %" PRIu64 " pixels damaged\n",
+		  output->name, output->damage.last_frame);
+
+	ivi_startup_output_frame(output);
+	ivi_metrics_output_frame(output);
+	ivi_shell_window_list_flush(output->ivi);
+
+	if (output->presented_app_id) {
+		ivi_shell_activation_feedback(output->ivi,
+					      output->presented_app_id,
+					      IVI_ACTIVATION_PRESENTED);
+		free(output->presented_app_id);
+		output->presented_app_id = NULL;
+	}
 }
 
 struct ivi_output *
@@ -98,6 +149,7 @@ ivi_ensure_output(struct ivi_compositor *ivi, char *name,
 	output->ivi = ivi;
 	output->name = name;
 	output->config = config;
+	wl_list_init(&output->standby);
 
 	output->output = weston_compositor_create_output(ivi->compositor, name);
 	if (!output->output) {
@@ -110,7 +162,12 @@ ivi_ensure_output(struct ivi_compositor *ivi, char *name,
 	weston_output_add_destroy_listener(output->output,
 					   &output->output_destroy);
 
+	output->output_frame.notify = handle_output_frame;
+	wl_signal_add(&output->output->frame_signal, &output->output_frame);
+
 	wl_list_insert(&ivi->outputs, &output->link);
+	ivi_flight_record(FLIGHT_RECORDER_OUTPUT_ADDED, output->output->id, 0);
+	ivi_debug(ivi, IVI_DEBUG_OUTPUT, "output %s created\n", name);
 	return output;
 }
 
@@ -747,6 +804,41 @@ load_x11_backend(struct ivi_compositor *ivi, int *argc, char *argv[])
 	return windowed_create_outputs(ivi, output_count, "X", "screen");
 }
 
+static int
+load_headless_backend(struct ivi_compositor *ivi, int *argc, char *argv[])
+{
+	struct weston_headless_backend_config config = {
+		.base = {
+			.struct_version = WESTON_HEADLESS_BACKEND_CONFIG_VERSION,
+			.struct_size = sizeof config,
+		},
+	};
+	bool fullscreen;
+	int output_count;
+	int ret;
+
+	/*
+	 * The headless backend has no windows to make fullscreen, we just
+	 * share the size, scale, pixman and output count options with the
+	 * other windowed backends.
+	 */
+	windowed_parse_common_options(ivi, argc, argv, &config.use_pixman,
+				      &fullscreen, &output_count);
+
+	ret = weston_compositor_load_backend(ivi->compositor, WESTON_BACKEND_HEADLESS,
+					     &config.base);
+	if (ret < 0)
+		return ret;
+
+	ivi->window_api = weston_windowed_output_get_api(ivi->compositor);
+	if (!ivi->window_api) {
+		weston_log("Cannot use weston_windowed_output_api.\n");
+		return -1;
+	}
+
+	return windowed_create_outputs(ivi, output_count, "headless", "headless");
+}
+
 static int
 load_backend(struct ivi_compositor *ivi, const char *backend,
 	     int *argc, char *argv[])
@@ -757,6 +849,8 @@ load_backend(struct ivi_compositor *ivi, const char *backend,
 		return load_wayland_backend(ivi, argc, argv);
 	} else if (strcmp(backend, "x11-backend.so") == 0) {
 		return load_x11_backend(ivi, argc, argv);
+	} else if (strcmp(backend, "headless-backend.so") == 0) {
+		return load_headless_backend(ivi, argc, argv);
 	}
 
 	weston_log("fatal: unknown backend '%s'.\n", backend);
@@ -967,36 +1061,42 @@ load_config(struct weston_config **config, bool no_config,
 }
 
 static FILE *logfile;
+static bool logfile_async;
 //static struct weston_log_scope *log_scope;
 //static struct weston_log_scope *protocol_scope;
 
 static int
 log_timestamp(void)
 {
-	static int cached_tm_mday = -1;
 	struct timespec ts;
-	struct tm brokendown_time;
-	char buf[128];
 
 	clock_gettime(CLOCK_REALTIME, &ts);
-	if (!localtime_r(&ts.tv_sec, &brokendown_time))
-		return fprintf(logfile, "[(NULL)localtime] ");
 
-	if (brokendown_time.tm_mday != cached_tm_mday) {
-		strftime(buf, sizeof buf, "%Y-%m-%d %Z", &brokendown_time);
-		fprintf(logfile, "Date: %s\n", buf);
-
-		cached_tm_mday = brokendown_time.tm_mday;
-	}
+	return ivi_log_timestamp(logfile, &ts);
+}
 
-	strftime(buf, sizeof buf, "%H:%M:%S", &brokendown_time);
+static void
+log_async_printf(const char *fmt, ...)
+{
+	va_list ap;
 
-	return fprintf(logfile, "[%s.%03ld] ", buf, ts.tv_nsec / 1000000);
+	va_start(ap, fmt);
+	ivi_log_async_vprintf(true, fmt, ap);
+	va_end(ap);
 }
 
 static void
 custom_handler(const char *fmt, va_list arg)
 {
+	char line[1024];
+
+	/* the file belongs to the writer thread */
+	if (logfile_async) {
+		vsnprintf(line, sizeof line, fmt, arg);
+		log_async_printf("libwayland: %s", line);
+		return;
+	}
+
 	log_timestamp();
 	fprintf(logfile, "libwayland: ");
 	vfprintf(logfile, fmt, arg);
@@ -1043,13 +1143,92 @@ vlog_continue(const char *fmt, va_list ap)
 	return vfprintf(logfile, fmt, ap);
 }
 
+static int
+vlog_async(const char *fmt, va_list ap)
+{
+	return ivi_log_async_vprintf(true, fmt, ap);
+}
+
+static int
+vlog_async_continue(const char *fmt, va_list ap)
+{
+	return ivi_log_async_vprintf(false, fmt, ap);
+}
+
+static void
+ivi_compositor_terminate(struct ivi_compositor *ivi)
+{
+	ivi_loop_stats_stop(ivi);
+	wl_display_terminate(ivi->compositor->wl_display);
+}
+
 static int
 on_term_signal(int signo, void *data)
 {
-	struct wl_display *display = data;
+	struct ivi_compositor *ivi = data;
 
+	ivi_loop_stats_enter(ivi, IVI_LOOP_SOURCE_SIGNAL);
 	weston_log("caught signal %d\n", signo);
-	wl_display_terminate(display);
+	ivi_compositor_terminate(ivi);
+	ivi_loop_stats_leave(ivi);
+
+	return 1;
+}
+
+static int
+on_dump_signal(int signo, void *data)
+{
+	struct ivi_compositor *ivi = data;
+
+	ivi_loop_stats_enter(ivi, IVI_LOOP_SOURCE_SIGNAL);
+	ivi_flight_recorder_dump();
+	ivi_loop_stats_dump(ivi);
+	ivi_loop_stats_leave(ivi);
+
+	return 1;
+}
+
+static void
+handle_client_destroyed(struct wl_listener *listener, void *data)
+{
+	struct wl_client *client = data;
+	pid_t pid;
+
+	wl_client_get_credentials(client, &pid, NULL, NULL);
+	ivi_flight_record(FLIGHT_RECORDER_CLIENT_DESTROYED, pid,
+			  (uintptr_t) client);
+
+	wl_list_remove(&listener->link);
+	free(listener);
+}
+
+static void
+handle_client_created(struct wl_listener *listener, void *data)
+{
+	struct wl_client *client = data;
+	struct wl_listener *destroy;
+	pid_t pid;
+
+	wl_client_get_credentials(client, &pid, NULL, NULL);
+	ivi_flight_record(FLIGHT_RECORDER_CLIENT_CREATED, pid,
+			  (uintptr_t) client);
+
+	destroy = zalloc(sizeof(*destroy));
+	if (!destroy)
+		return;
+
+	destroy->notify = handle_client_destroyed;
+	wl_client_add_destroy_listener(client, destroy);
+}
+
+static int
+on_debug_signal(int signo, void *data)
+{
+	struct ivi_compositor *ivi = data;
+
+	ivi_loop_stats_enter(ivi, IVI_LOOP_SOURCE_SIGNAL);
+	ivi_debug_toggle(ivi);
+	ivi_loop_stats_leave(ivi);
 
 	return 1;
 }
@@ -1057,7 +1236,10 @@ on_term_signal(int signo, void *data)
 static void
 handle_exit(struct weston_compositor *compositor)
 {
-	wl_display_terminate(compositor->wl_display);
+	ivi_flight_record(FLIGHT_RECORDER_EXIT, 0, 0);
+	ivi_flight_recorder_dump();
+
+	ivi_compositor_terminate(to_ivi_compositor(compositor));
 }
 
 static void
@@ -1078,16 +1260,68 @@ usage(int error_code)
 			"\t\t\t\tdrm-backend.so\n"
 			"\t\t\t\twayland-backend.so\n"
 			"\t\t\t\tx11-backend.so\n"
+			"\t\t\t\theadless-backend.so\n"
 		"  -S, --socket=NAME\tName of socket to listen on\n"
 		"  --log=FILE\t\tLog to the given file\n"
+		"  --log-async\t\tWrite the log from a separate thread\n"
 		"  -c, --config=FILE\tConfig file to load, defaults to agl-compositor.ini\n"
 		"  --no-config\t\tDo not read agl-compositor.ini\n"
 		"  --debug\t\tEnable debug extension\n"
 		"  -h, --help\t\tThis help message\n"
+		"\n"
+		"Options for wayland, x11 and headless backends:\n"
+		"\n"
+		"  --width=WIDTH\t\tWidth of the outputs\n"
+		"  --height=HEIGHT\tHeight of the outputs\n"
+		"  --scale=SCALE\t\tScale factor of the outputs\n"
+		"  --use-pixman\t\tUse the pixman (CPU) renderer\n"
+		"  --output-count=COUNT\tCreate multiple outputs\n"
 		"\n");
 	exit(error_code);
 }
 
+static void
+ivi_compositor_get_hidden_fps(struct ivi_compositor *ivi)
+{
+	struct weston_config_section *section;
+
+	section = weston_config_get_section(ivi->config, "shell", NULL, NULL);
+	weston_config_section_get_int(section, "hidden-fps",
+				      &ivi->hidden_fps, -1);
+}
+
+static void
+ivi_compositor_get_standby(struct ivi_compositor *ivi)
+{
+	struct weston_config_section *section;
+
+	section = weston_config_get_section(ivi->config, "shell", NULL, NULL);
+	weston_config_section_get_int(section, "standby-apps",
+				      &ivi->standby_apps, 0);
+	weston_config_section_get_int(section, "standby-fps",
+				      &ivi->standby_fps, 1);
+}
+
+static void
+ivi_compositor_get_preconfigure(struct ivi_compositor *ivi)
+{
+	struct weston_config_section *section;
+
+	section = weston_config_get_section(ivi->config, "shell", NULL, NULL);
+	weston_config_section_get_bool(section, "preconfigure",
+				       &ivi->preconfigure, 0);
+}
+
+static void
+ivi_compositor_get_transaction_timeout(struct ivi_compositor *ivi)
+{
+	struct weston_config_section *section;
+
+	section = weston_config_get_section(ivi->config, "shell", NULL, NULL);
+	weston_config_section_get_int(section, "transaction-timeout",
+				      &ivi->transaction_timeout, 1000);
+}
+
 static void
 ivi_compositor_get_quirks(struct ivi_compositor *ivi)
 {
@@ -1107,12 +1341,14 @@ int main(int argc, char *argv[])
 	struct ivi_compositor ivi = { 0 };
 	struct wl_display *display = NULL;
 	struct wl_event_loop *loop;
-	struct wl_event_source *signals[3] = { 0 };
+	struct wl_event_source *signals[5] = { 0 };
+	struct wl_listener client_created;
 	struct weston_config_section *section;
 	/* Command line options */
 	char *backend = NULL;
 	char *socket_name = NULL;
 	char *log = NULL;
+	int log_async = 0;
 	int help = 0;
 	int version = 0;
 	int no_config = 0;
@@ -1123,6 +1359,7 @@ int main(int argc, char *argv[])
 		{ WESTON_OPTION_STRING, "backend", 'B', &backend },
 		{ WESTON_OPTION_STRING, "socket", 'S', &socket_name },
 		{ WESTON_OPTION_STRING, "log", 0, &log },
+		{ WESTON_OPTION_BOOLEAN, "log-async", 0, &log_async },
 		{ WESTON_OPTION_BOOLEAN, "help", 'h', &help },
 		{ WESTON_OPTION_BOOLEAN, "version", 0, &version },
 		{ WESTON_OPTION_BOOLEAN, "no-config", 0, &no_config },
@@ -1133,6 +1370,11 @@ int main(int argc, char *argv[])
 	wl_list_init(&ivi.outputs);
 	wl_list_init(&ivi.surfaces);
 	wl_list_init(&ivi.pending_surfaces);
+	wl_list_init(&ivi.shell_client.clients);
+	wl_list_init(&ivi.shell_client.resources);
+	wl_signal_init(&ivi.first_frame_signal);
+	ivi_layout_init_app_index(&ivi);
+	ivi_startup_init(&ivi);
 
 	/* Prevent any clients we spawn getting our stdin */
 	os_fd_set_cloexec(STDIN_FILENO);
@@ -1148,7 +1390,12 @@ int main(int argc, char *argv[])
 	}
 
 	log_file_open(log);
-	weston_log_set_handler(vlog, vlog_continue);
+	logfile_async = log_async && ivi_log_async_start(logfile) == 0;
+	if (logfile_async)
+		weston_log_set_handler(vlog_async, vlog_async_continue);
+	else
+		weston_log_set_handler(vlog, vlog_continue);
+	ivi_startup_phase(&ivi, "log");
 
 	if (load_config(&ivi.config, no_config, config_file) < 0)
 		goto error_signals;
@@ -1161,6 +1408,13 @@ int main(int argc, char *argv[])
 	}
 
 	ivi_compositor_get_quirks(&ivi);
+	ivi_compositor_get_hidden_fps(&ivi);
+	ivi_compositor_get_preconfigure(&ivi);
+	ivi_compositor_get_standby(&ivi);
+	ivi_compositor_get_transaction_timeout(&ivi);
+	ivi_debug_init(&ivi);
+	ivi_flight_recorder_init(&ivi);
+	ivi_startup_phase(&ivi, "config");
 
 	display = wl_display_create();
 	loop = wl_display_get_event_loop(display);
@@ -1168,14 +1422,21 @@ int main(int argc, char *argv[])
 	wl_display_set_global_filter(display,
 				     global_filter, &ivi);
 
+	client_created.notify = handle_client_created;
+	wl_display_add_client_created_listener(display, &client_created);
+
 	/* Register signal handlers so we shut down cleanly */
 
 	signals[0] = wl_event_loop_add_signal(loop, SIGTERM, on_term_signal,
-					      display);
+					      &ivi);
 	signals[1] = wl_event_loop_add_signal(loop, SIGINT, on_term_signal,
-					      display);
+					      &ivi);
 	signals[2] = wl_event_loop_add_signal(loop, SIGQUIT, on_term_signal,
-					      display);
+					      &ivi);
+	signals[3] = wl_event_loop_add_signal(loop, SIGUSR2, on_debug_signal,
+					      &ivi);
+	signals[4] = wl_event_loop_add_signal(loop, SIGUSR1,
+					      on_dump_signal, &ivi);
 
 	for (size_t i = 0; i < ARRAY_LENGTH(signals); ++i)
 		if (!signals[i])
@@ -1189,12 +1450,17 @@ int main(int argc, char *argv[])
 
 	if (compositor_init_config(ivi.compositor, ivi.config) < 0)
 		goto error_compositor;
+	ivi_startup_phase(&ivi, "compositor");
 
 	if (load_backend(&ivi, backend, &argc, argv) < 0) {
 		weston_log("fatal: failed to create compositor backend.\n");
 		goto error_compositor;
 	}
 
+	/* not fatal, only monitoring depends on it */
+	ivi_metrics_init(&ivi);
+	ivi_startup_phase(&ivi, "backend");
+
 	ivi.heads_changed.notify = heads_changed;
 	weston_compositor_add_heads_changed_listener(ivi.compositor,
 						     &ivi.heads_changed);
@@ -1206,10 +1472,17 @@ int main(int argc, char *argv[])
 		goto error_compositor;
 
 	add_bindings(ivi.compositor);
+	ivi_startup_phase(&ivi, "shell-init");
 
 	weston_compositor_flush_heads_changed(ivi.compositor);
+	ivi_startup_phase(&ivi, "outputs");
 
 	ivi_shell_init_black_fs(&ivi);
+	ivi_splash_init(&ivi);
+	ivi_startup_phase(&ivi, "splash");
+
+	if (ivi_loop_stats_init(&ivi) < 0)
+		goto error_compositor;
 
 	if (create_listening_socket(display, socket_name) < 0)
 		goto error_compositor;
@@ -1218,24 +1491,43 @@ int main(int argc, char *argv[])
 
 	weston_compositor_wake(ivi.compositor);
 
+	ivi_startup_phase(&ivi, "socket");
+
 	ivi_shell_create_global(&ivi);
 	ivi_launch_shell_client(&ivi);
+	ivi_startup_phase(&ivi, "shell-clients");
 	ivi_agl_systemd_notify(&ivi);
+	ivi_startup_phase(&ivi, "notify");
 
-	wl_display_run(display);
+	if (ivi.loop_stats)
+		ivi_loop_stats_run(&ivi);
+	else
+		wl_display_run(display);
 
+	ivi_splash_destroy(&ivi);
 	wl_display_destroy_clients(display);
 
 error_compositor:
+	ivi_loop_stats_destroy(&ivi);
+	ivi_metrics_destroy(&ivi);
 	weston_compositor_destroy(ivi.compositor);
 
 error_signals:
+	/* when exiting before the first frames, e.g. on a failed start-up */
+	ivi_startup_finish(&ivi);
+
 	for (size_t i = 0; i < ARRAY_LENGTH(signals); ++i)
 		if (signals[i])
 			wl_event_source_remove(signals[i]);
 
 	wl_display_destroy(display);
 
+	ivi_debug_destroy(&ivi);
+	if (logfile_async) {
+		logfile_async = false;
+		weston_log_set_handler(vlog, vlog_continue);
+		ivi_log_async_stop();
+	}
 	log_file_close();
 	if (ivi.config)
 		weston_config_destroy(ivi.config);
@@ -0,0 +1,389 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Metrics page
+ *
+ * Frame counts, repaint times and the active app_id of every output, along
+ * with the number of surfaces per role and of clients, are kept in a shared
+ * memory page laid out as in shared/metrics.h, for monitoring daemons to
+ * read whenever they like without talking to the compositor at all. The
+ * compositor only writes to memory, behind a sequence lock, on repaints and
+ * when clients and surfaces come and go.
+ *
+ * The page is the file given by metrics-path in [core], or
+ * agl-compositor-metrics in XDG_RUNTIME_DIR by default. It is set up under a
+ * temporary name and renamed into place, so it never shows up half
+ * initialised, and removed on exit.
+ */
+
+#include "ivi-compositor.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libweston-6/config-parser.h>
+
+#include "shared/helpers.h"
+#include "shared/metrics.h"
+#include "shared/timespec-util.h"
+
+struct ivi_metrics {
+	struct metrics_page *page;
+	char *path;
+	struct wl_listener client_created;
+	struct wl_list clients;	/* metrics_client.link */
+};
+
+struct metrics_client {
+	struct ivi_metrics *metrics;
+	struct wl_list link;	/* ivi_metrics.clients */
+	struct wl_listener destroy;
+};
+
+static void
+metrics_begin(struct metrics_page *page)
+{
+	__atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+metrics_end(struct metrics_page *page)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	page->update_time = timespec_to_nsec(&now);
+
+	__atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void
+metrics_client_destroyed(struct wl_listener *listener, void *data)
+{
+	struct metrics_client *client =
+		wl_container_of(listener, client, destroy);
+	struct metrics_page *page = client->metrics->page;
+
+	metrics_begin(page);
+	page->clients--;
+	metrics_end(page);
+
+	wl_list_remove(&client->link);
+	wl_list_remove(&client->destroy.link);
+	free(client);
+}
+
+static void
+metrics_client_created(struct wl_listener *listener, void *data)
+{
+	struct ivi_metrics *metrics =
+		wl_container_of(listener, metrics, client_created);
+	struct wl_client *wl_client = data;
+	struct metrics_client *client;
+
+	client = zalloc(sizeof(*client));
+	if (!client)
+		return;
+
+	client->metrics = metrics;
+	client->destroy.notify = metrics_client_destroyed;
+	wl_client_add_destroy_listener(wl_client, &client->destroy);
+	wl_list_insert(&metrics->clients, &client->link);
+
+	metrics_begin(metrics->page);
+	metrics->page->clients++;
+	metrics_end(metrics->page);
+}
+
+static struct metrics_page *
+metrics_page_create(const char *path)
+{
+	struct metrics_page *page;
+	char *tmp;
+	int fd;
+
+	if (asprintf(&tmp, "%s.XXXXXX", path) < 0)
+		return NULL;
+
+	fd = mkostemp(tmp, O_CLOEXEC);
+	if (fd < 0) {
+		free(tmp);
+		return NULL;
+	}
+
+	if (fchmod(fd, 0644) < 0 || ftruncate(fd, sizeof(*page)) < 0) {
+		close(fd);
+		unlink(tmp);
+		free(tmp);
+		return NULL;
+	}
+
+	page = mmap(NULL, sizeof(*page), PROT_READ | PROT_WRITE, MAP_SHARED,
+		    fd, 0);
+	close(fd);
+	if (page == MAP_FAILED) {
+		unlink(tmp);
+		free(tmp);
+		return NULL;
+	}
+
+	memcpy(page->magic, METRICS_MAGIC, sizeof(page->magic));
+	page->version = METRICS_VERSION;
+	page->size = sizeof(*page);
+
+	if (rename(tmp, path) < 0) {
+		munmap(page, sizeof(*page));
+		unlink(tmp);
+		free(tmp);
+		return NULL;
+	}
+
+	free(tmp);
+
+	return page;
+}
+
+int
+ivi_metrics_init(struct ivi_compositor *ivi)
+{
+	struct weston_config_section *section;
+	struct ivi_metrics *metrics;
+	const char *dir;
+	char *path;
+
+	section = weston_config_get_section(ivi->config, "core", NULL, NULL);
+	weston_config_section_get_string(section, "metrics-path", &path, NULL);
+	if (!path) {
+		dir = getenv("XDG_RUNTIME_DIR");
+		if (asprintf(&path, "%s/agl-compositor-metrics",
+			     dir ? dir : "/tmp") < 0)
+			return -1;
+	}
+
+	metrics = zalloc(sizeof(*metrics));
+	if (!metrics) {
+		free(path);
+		return -1;
+	}
+
+	metrics->path = path;
+	wl_list_init(&metrics->clients);
+	metrics->page = metrics_page_create(path);
+	if (!metrics->page) {
+		weston_log("Failed to create the metrics page %s: %s\n",
+			   path, strerror(errno));
+		free(path);
+		free(metrics);
+		return -1;
+	}
+
+	metrics->page->repaint_window_msec = ivi->compositor->repaint_msec;
+
+	metrics->client_created.notify = metrics_client_created;
+	wl_display_add_client_created_listener(ivi->compositor->wl_display,
+					       &metrics->client_created);
+
+	ivi->metrics = metrics;
+	weston_log("Metrics available in %s\n", path);
+
+	return 0;
+}
+
+void
+ivi_metrics_destroy(struct ivi_compositor *ivi)
+{
+	struct ivi_metrics *metrics = ivi->metrics;
+	struct metrics_client *client, *tmp;
+
+	if (!metrics)
+		return;
+
+	ivi->metrics = NULL;
+
+	wl_list_remove(&metrics->client_created.link);
+
+	/* clients can outlive us, e.g. the splash one on a failed start-up */
+	wl_list_for_each_safe(client, tmp, &metrics->clients, link) {
+		wl_list_remove(&client->link);
+		wl_list_remove(&client->destroy.link);
+		free(client);
+	}
+
+	unlink(metrics->path);
+	munmap(metrics->page, sizeof(*metrics->page));
+	free(metrics->path);
+	free(metrics);
+}
+
+/* For the compositor's own clients, which are not worth monitoring */
+void
+ivi_metrics_client_ignore(struct ivi_compositor *ivi,
+			  struct wl_client *wl_client)
+{
+	struct metrics_client *client;
+	struct wl_listener *listener;
+
+	listener = wl_client_get_destroy_listener(wl_client,
+						  metrics_client_destroyed);
+	if (!listener)
+		return;
+
+	/* same as the client going away, as far as the page is concerned */
+	client = wl_container_of(listener, client, destroy);
+	metrics_client_destroyed(&client->destroy, wl_client);
+}
+
+void
+ivi_metrics_surface_added(struct ivi_compositor *ivi,
+			  enum ivi_surface_role role)
+{
+	struct metrics_page *page;
+
+	if (!ivi->metrics || role >= ARRAY_LENGTH(page->surfaces))
+		return;
+
+	page = ivi->metrics->page;
+	metrics_begin(page);
+	page->surfaces[role]++;
+	metrics_end(page);
+}
+
+void
+ivi_metrics_surface_removed(struct ivi_compositor *ivi,
+			    enum ivi_surface_role role)
+{
+	struct metrics_page *page;
+
+	if (!ivi->metrics || role >= ARRAY_LENGTH(page->surfaces))
+		return;
+
+	page = ivi->metrics->page;
+	metrics_begin(page);
+	page->surfaces[role]--;
+	metrics_end(page);
+}
+
+static struct metrics_output *
+metrics_output_slot(struct metrics_page *page, struct ivi_output *output)
+{
+	struct metrics_output *free_slot = NULL;
+
+	for (int i = 0; i < METRICS_MAX_OUTPUTS; i++) {
+		struct metrics_output *slot = &page->outputs[i];
+
+		if (slot->name[0] == '\0') {
+			if (!free_slot)
+				free_slot = slot;
+		} else if (strncmp(slot->name, output->name,
+				   sizeof(slot->name) - 1) == 0) {
+			return slot;
+		}
+	}
+
+	if (free_slot) {
+		memset(free_slot, 0, sizeof(*free_slot));
+		snprintf(free_slot->name, sizeof(free_slot->name), "%s",
+			 output->name);
+	}
+
+	return free_slot;
+}
+
+/* Called on every repaint of the output */
+void
+ivi_metrics_output_frame(struct ivi_output *output)
+{
+	struct ivi_compositor *ivi = output->ivi;
+	struct weston_output *woutput = output->output;
+	struct metrics_page *page;
+	struct metrics_output *slot;
+	struct timespec now;
+	uint64_t usec;
+
+	if (!ivi->metrics)
+		return;
+
+	page = ivi->metrics->page;
+
+	/* next_repaint is when this repaint was due */
+	weston_compositor_read_presentation_clock(ivi->compositor, &now);
+	usec = timespec_sub_to_nsec(&now, &woutput->next_repaint) / 1000;
+
+	metrics_begin(page);
+
+	slot = metrics_output_slot(page, output);
+	if (slot) {
+		slot->id = woutput->id;
+		slot->enabled = woutput->enabled;
+		slot->frames++;
+		if (usec > (uint64_t) ivi->compositor->repaint_msec * 1000)
+			slot->missed_frames++;
+		slot->repaint_usec_last = usec;
+		if (usec > slot->repaint_usec_max)
+			slot->repaint_usec_max = usec;
+		slot->repaint_usec_total += usec;
+
+		if (output->active && output->active->app_id)
+			snprintf(slot->active_app_id,
+				 sizeof(slot->active_app_id), "%s",
+				 output->active->app_id);
+		else
+			slot->active_app_id[0] = '\0';
+	}
+
+	metrics_end(page);
+}
+
+void
+ivi_metrics_output_destroyed(struct ivi_output *output)
+{
+	struct metrics_page *page;
+
+	if (!output->ivi->metrics)
+		return;
+
+	page = output->ivi->metrics->page;
+
+	for (int i = 0; i < METRICS_MAX_OUTPUTS; i++) {
+		struct metrics_output *slot = &page->outputs[i];
+
+		if (strncmp(slot->name, output->name,
+			    sizeof(slot->name) - 1) == 0) {
+			metrics_begin(page);
+			memset(slot, 0, sizeof(*slot));
+			metrics_end(page);
+			break;
+		}
+	}
+}
@@ -28,7 +28,11 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -36,7 +40,10 @@
 #include <libweston-6/compositor.h>
 #include <libweston-6/config-parser.h>
 
+#include "shared/flight-recorder.h"
+#include "shared/helpers.h"
 #include "shared/os-compatibility.h"
+#include "shared/timespec-util.h"
 
 #include "agl-shell-server-protocol.h"
 
@@ -46,13 +53,23 @@ create_black_surface_view(struct ivi_output *output);
 static void
 insert_black_surface(struct ivi_output *output);
 
+/* Keeps the per-role surface counts in the metrics page in sync */
+void
+ivi_surface_set_role(struct ivi_surface *surface, enum ivi_surface_role role)
+{
+	ivi_metrics_surface_removed(surface->ivi, surface->role);
+	surface->role = role;
+	ivi_metrics_surface_added(surface->ivi, surface->role);
+}
+
 void
 ivi_set_desktop_surface(struct ivi_surface *surface)
 {
 	assert(surface->role == IVI_SURFACE_ROLE_NONE);
 
-	surface->role = IVI_SURFACE_ROLE_DESKTOP;
+	ivi_surface_set_role(surface, IVI_SURFACE_ROLE_DESKTOP);
 	wl_list_insert(&surface->ivi->surfaces, &surface->link);
+	ivi_layout_update_app_id(surface);
 }
 
 void
@@ -86,45 +103,111 @@ ivi_shell_init(struct ivi_compositor *ivi)
 	weston_layer_set_position(&ivi->fullscreen,
 				  WESTON_LAYER_POSITION_FULLSCREEN);
 
+	wl_list_init(&ivi->window_list.changed);
+	wl_array_init(&ivi->window_list.closed);
+
 	return 0;
 }
 
-static void
-client_exec(const char *command, int fd)
+/*
+ * Builds the environment of the client: ours, with WAYLAND_SOCKET pointing to
+ * its end of the socketpair.
+ */
+static char **
+client_env(int fd)
 {
-	sigset_t sig;
-	char s[32];
+	extern char **environ;
+	char **env, **e;
+	size_t n = 0;
+	int i = 0;
 
-	/* Don't give the child our signal mask */
-	sigfillset(&sig);
-	sigprocmask(SIG_UNBLOCK, &sig, NULL);
+	for (e = environ; *e; e++)
+		n++;
 
-	/* Launch clients as the user; don't give them the wrong euid */
-	if (seteuid(getuid()) == -1) {
-		weston_log("seteuid failed: %s\n", strerror(errno));
-		return;
+	env = calloc(n + 2, sizeof(*env));
+	if (!env)
+		return NULL;
+
+	if (asprintf(&env[i++], "WAYLAND_SOCKET=%d", fd) < 0) {
+		free(env);
+		return NULL;
+	}
+
+	for (e = environ; *e; e++)
+		if (strncmp(*e, "WAYLAND_SOCKET=", 15) != 0)
+			env[i++] = *e;
+
+	return env;
+}
+
+/*
+ * posix_spawn() doesn't copy our address space, unlike fork(), which gets
+ * expensive once the backend and renderer are loaded and stalls the main
+ * loop while the page tables are copied.
+ */
+static pid_t
+client_spawn(const char *command, int fd)
+{
+	char *argv[] = { "/bin/sh", "-c", (char *) command, NULL };
+	posix_spawnattr_t attr;
+	int flags;
+	sigset_t sig;
+	char **env;
+	pid_t pid;
+	int ret;
+
+	env = client_env(fd);
+	if (!env) {
+		errno = ENOMEM;
+		return -1;
 	}
 
-	/* Duplicate fd to unset the CLOEXEC flag. We don't need to worry about
-	 * clobbering fd, as we'll exit/exec either way.
+	/*
+	 * The caller closes fd right after, so clear CLOEXEC on it here; a
+	 * dup2() onto itself in the file actions only does that on glibc 2.29
+	 * and later.
 	 */
-	fd = dup(fd);
-	if (fd == -1) {
-		weston_log("dup failed: %s\n", strerror(errno));
-		return;
+	flags = fcntl(fd, F_GETFD);
+	if (flags < 0 || fcntl(fd, F_SETFD, flags & ~FD_CLOEXEC) < 0) {
+		free(env[0]);
+		free(env);
+		return -1;
 	}
 
-	snprintf(s, sizeof s, "%d", fd);
-	setenv("WAYLAND_SOCKET", s, 1);
+	posix_spawnattr_init(&attr);
+
+	/*
+	 * Launch clients as the user; don't give them the wrong euid, nor our
+	 * signal mask and handlers.
+	 */
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_RESETIDS |
+					POSIX_SPAWN_SETSIGMASK |
+					POSIX_SPAWN_SETSIGDEF);
+	sigemptyset(&sig);
+	posix_spawnattr_setsigmask(&attr, &sig);
+	sigfillset(&sig);
+	posix_spawnattr_setsigdefault(&attr, &sig);
+
+	ret = posix_spawn(&pid, "/bin/sh", NULL, &attr, argv, env);
 
-	execl("/bin/sh", "/bin/sh", "-c", command, NULL);
-	weston_log("executing '%s' failed: %s", command, strerror(errno));
+	posix_spawnattr_destroy(&attr);
+	free(env[0]);
+	free(env);
+
+	if (ret != 0) {
+		errno = ret;
+		return -1;
+	}
+
+	return pid;
 }
 
 static struct wl_client *
-launch_shell_client(struct ivi_compositor *ivi, const char *command)
+launch_shell_client(struct ivi_compositor *ivi, const char *command,
+		    pid_t *out_pid)
 {
 	struct wl_client *client;
+	struct timespec start, end;
 	int sock[2];
 	pid_t pid;
 
@@ -136,20 +219,22 @@ launch_shell_client(struct ivi_compositor *ivi, const char *command)
 		return NULL;
 	}
 
-	pid = fork();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pid = client_spawn(command, sock[1]);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	close(sock[1]);
 	if (pid == -1) {
 		close(sock[0]);
-		close(sock[1]);
-		weston_log("fork failed while launching '%s': %s\n",
+		weston_log("spawn failed while launching '%s': %s\n",
 			   command, strerror(errno));
 		return NULL;
 	}
 
-	if (pid == 0) {
-		client_exec(command, sock[1]);
-		_Exit(EXIT_FAILURE);
-	}
-	close(sock[1]);
+	weston_log("launched '%s' as pid %d in %" PRId64 " us\n", command, pid,
+		   timespec_sub_to_nsec(&end, &start) / 1000);
+	ivi_startup_span(ivi, timespec_to_nsec(&start), timespec_to_nsec(&end),
+			 "spawn %s", command);
 
 	client = wl_client_create(ivi->compositor->wl_display, sock[0]);
 	if (!client) {
@@ -159,29 +244,96 @@ launch_shell_client(struct ivi_compositor *ivi, const char *command)
 		return NULL;
 	}
 
+	*out_pid = pid;
 	return client;
 }
 
+static void
+shell_client_destroy(struct wl_listener *listener, void *data)
+{
+	struct ivi_shell_client *shell_client =
+		wl_container_of(listener, shell_client, client_destroy);
+
+	weston_log("Shell client '%s' (pid %d) went away\n",
+		   shell_client->command, shell_client->pid);
+
+	wl_list_remove(&shell_client->client_destroy.link);
+	wl_list_init(&shell_client->client_destroy.link);
+	shell_client->client = NULL;
+
+	/* don't keep waiting on it */
+	if (shell_client->require_ready && !shell_client->ready)
+		ivi_shell_check_ready(shell_client->ivi);
+}
+
+struct ivi_shell_client *
+ivi_shell_client_from_wl(struct wl_client *client)
+{
+	struct ivi_shell_client *shell_client;
+	struct wl_listener *listener;
+
+	listener = wl_client_get_destroy_listener(client, shell_client_destroy);
+	if (!listener)
+		return NULL;
+
+	return wl_container_of(listener, shell_client, client_destroy);
+}
+
+/*
+ * Launches the command of every [shell-client] section, all at once. The
+ * ones with require-ready=true, the default, all have to call ready before
+ * the black surface and splash screen go away.
+ */
 int
 ivi_launch_shell_client(struct ivi_compositor *ivi)
 {
-	struct weston_config_section *section;
-	char *command = NULL;
+	struct weston_config_section *section = NULL;
+	const char *name;
+	int launched = 0;
+
+	while (weston_config_next_section(ivi->config, &section, &name)) {
+		struct ivi_shell_client *shell_client;
+		char *command = NULL;
+		int require_ready;
+
+		if (strcmp(name, "shell-client") != 0)
+			continue;
 
-	section = weston_config_get_section(ivi->config, "shell-client",
-					    NULL, NULL);
-	if (section)
 		weston_config_section_get_string(section, "command",
 						 &command, NULL);
+		if (!command)
+			continue;
 
-	if (!command)
-		return -1;
+		weston_config_section_get_bool(section, "require-ready",
+					       &require_ready, 1);
 
-	ivi->shell_client.client = launch_shell_client(ivi, command);
-	if (!ivi->shell_client.client)
-		return -1;
+		shell_client = zalloc(sizeof(*shell_client));
+		if (!shell_client) {
+			free(command);
+			continue;
+		}
 
-	return 0;
+		shell_client->ivi = ivi;
+		shell_client->command = command;
+		shell_client->require_ready = require_ready;
+		shell_client->client =
+			launch_shell_client(ivi, command, &shell_client->pid);
+		if (!shell_client->client) {
+			free(command);
+			free(shell_client);
+			continue;
+		}
+
+		shell_client->client_destroy.notify = shell_client_destroy;
+		wl_client_add_destroy_listener(shell_client->client,
+					       &shell_client->client_destroy);
+
+		wl_list_insert(ivi->shell_client.clients.prev,
+			       &shell_client->link);
+		launched++;
+	}
+
+	return launched > 0 ? 0 : -1;
 }
 
 static void
@@ -240,10 +392,11 @@ remove_black_surface(struct ivi_output *output)
 	view->is_mapped = false;
 	view->surface->is_mapped = false;
 
-	weston_layer_entry_remove(&view->layer_link);
+	ivi_layer_remove(view);
 	weston_view_update_transform(view);
 
-	weston_output_damage(output->output);
+	/* the black surface covers the whole output */
+	ivi_layout_damage_view(output->ivi, view);
 }
 
 static void
@@ -254,29 +407,53 @@ insert_black_surface(struct ivi_output *output)
 	if (view->is_mapped || view->surface->is_mapped)
 		return;
 
-	weston_layer_entry_remove(&view->layer_link);
-	weston_layer_entry_insert(&output->ivi->fullscreen.view_list,
-				  &view->layer_link);
+	ivi_layer_remove(view);
+	ivi_layer_insert(&output->ivi->fullscreen, view);
 
 	view->is_mapped = true;
 	view->surface->is_mapped = true;
 
 	weston_view_update_transform(view);
-	weston_output_damage(output->output);
+	ivi_layout_damage_view(output->ivi, view);
 }
 
-static void
-shell_ready(struct wl_client *client, struct wl_resource *shell_res)
+/*
+ * Clients not launched by us, or no shell client requiring to be ready at
+ * all, means the first ready request is the one we are waiting for.
+ */
+static bool
+ivi_shell_has_required_clients(struct ivi_compositor *ivi)
 {
-	struct ivi_compositor *ivi = wl_resource_get_user_data(shell_res);
+	struct ivi_shell_client *shell_client;
+
+	wl_list_for_each(shell_client, &ivi->shell_client.clients, link)
+		if (shell_client->require_ready)
+			return true;
+
+	return false;
+}
+
+void
+ivi_shell_check_ready(struct ivi_compositor *ivi)
+{
+	struct ivi_shell_client *shell_client;
 	struct ivi_output *output;
 	struct ivi_surface *surface, *tmp;
 
 	/* Init already finished. Do nothing */
-	if (ivi->shell_client.ready)
+	if (ivi->shell_client.ready || !ivi->shell_client.ready_requested)
 		return;
 
+	wl_list_for_each(shell_client, &ivi->shell_client.clients, link)
+		if (shell_client->require_ready && shell_client->client &&
+		    !shell_client->ready)
+			return;
+
 	ivi->shell_client.ready = true;
+	ivi_flight_record(FLIGHT_RECORDER_SHELL_READY, 0, 0);
+	ivi_startup_instant(ivi, "shell ready");
+
+	ivi_splash_destroy(ivi);
 
 	wl_list_for_each(output, &ivi->outputs, link) {
 		remove_black_surface(output);
@@ -289,6 +466,317 @@ shell_ready(struct wl_client *client, struct wl_resource *shell_res)
 	}
 }
 
+/*
+ * Progress of activations, for agl_shell version 3 clients. All of them get
+ * it, whoever asked for the activation, so e.g. a launcher learns about the
+ * ones the homescreen makes.
+ */
+void
+ivi_shell_activation_feedback(struct ivi_compositor *ivi, const char *app_id,
+			      enum ivi_activation_stage stage)
+{
+	struct wl_resource *resource;
+	struct timespec now;
+	uint32_t sec_hi, sec_lo;
+
+	if (!app_id)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	sec_hi = (uint64_t) now.tv_sec >> 32;
+	sec_lo = now.tv_sec & 0xffffffff;
+
+	wl_resource_for_each(resource, &ivi->shell_client.resources) {
+		if (wl_resource_get_version(resource) <
+		    AGL_SHELL_ACTIVATE_ACCEPTED_SINCE_VERSION)
+			continue;
+
+		switch (stage) {
+		case IVI_ACTIVATION_ACCEPTED:
+			agl_shell_send_activate_accepted(resource, app_id,
+							 sec_hi, sec_lo,
+							 now.tv_nsec);
+			break;
+		case IVI_ACTIVATION_CONFIGURED:
+			agl_shell_send_activate_configured(resource, app_id,
+							   sec_hi, sec_lo,
+							   now.tv_nsec);
+			break;
+		case IVI_ACTIVATION_PRESENTED:
+			agl_shell_send_activate_presented(resource, app_id,
+							  sec_hi, sec_lo,
+							  now.tv_nsec);
+			break;
+		}
+	}
+}
+
+static const char *
+activate_error_name(enum agl_shell_activate_error error)
+{
+	switch (error) {
+	case AGL_SHELL_ACTIVATE_ERROR_UNKNOWN_APP_ID:
+		return "unknown app_id";
+	case AGL_SHELL_ACTIVATE_ERROR_SUPERSEDED:
+		return "superseded";
+	case AGL_SHELL_ACTIVATE_ERROR_UNKNOWN_HANDLE:
+		return "unknown handle";
+	}
+
+	return "?";
+}
+
+void
+ivi_shell_activation_failed(struct ivi_compositor *ivi, const char *app_id,
+			    enum agl_shell_activate_error error)
+{
+	struct wl_resource *resource;
+
+	ivi_debug(ivi, IVI_DEBUG_SHELL, "activation of %s failed: %s\n",
+		  app_id, activate_error_name(error));
+
+	wl_resource_for_each(resource, &ivi->shell_client.resources)
+		if (wl_resource_get_version(resource) >=
+		    AGL_SHELL_ACTIVATE_FAILED_SINCE_VERSION)
+			agl_shell_send_activate_failed(resource, app_id, error);
+}
+
+/* The wl_output of the client for 'output', if it bound one */
+static struct wl_resource *
+ivi_shell_output_resource(struct ivi_output *output, struct wl_client *client)
+{
+	struct weston_head *head = NULL;
+	struct wl_resource *resource;
+
+	if (!output || !output->output)
+		return NULL;
+
+	while ((head = weston_output_iterate_heads(output->output, head))) {
+		resource = wl_resource_find_for_client(&head->resource_list,
+						       client);
+		if (resource)
+			return resource;
+	}
+
+	return NULL;
+}
+
+static void
+shell_send_toplevel(struct wl_resource *resource, struct ivi_surface *surface)
+{
+	struct wl_client *client = wl_resource_get_client(resource);
+	struct weston_desktop_client *dclient =
+		weston_desktop_surface_get_client(surface->dsurface);
+	pid_t pid;
+
+	wl_client_get_credentials(weston_desktop_client_get_client(dclient),
+				  &pid, NULL, NULL);
+
+	agl_shell_send_toplevel(resource, surface->handle, surface->app_id, pid,
+				ivi_shell_output_resource(surface->desktop.last_output,
+							  client));
+}
+
+/*
+ * Window list
+ *
+ * agl_shell version 4 clients get told about every change of a toplevel as
+ * it happens. From version 5 on, changes are collected instead, and sent in
+ * one batch on the next repaint of any output, or after a frame's worth of
+ * time if nothing repaints, so that a burst of them doesn't flood the shell
+ * clients: a toplevel changing several times gets a single event, and one
+ * coming and going in between none at all. Nothing is collected without
+ * such clients, as binding sends the whole list anyway.
+ */
+
+#define IVI_WINDOW_LIST_DELAY_MS 16
+
+static bool
+ivi_shell_has_window_list_clients(struct ivi_compositor *ivi)
+{
+	struct wl_resource *resource;
+
+	wl_resource_for_each(resource, &ivi->shell_client.resources)
+		if (wl_resource_get_version(resource) >=
+		    AGL_SHELL_WINDOW_LIST_DONE_SINCE_VERSION)
+			return true;
+
+	return false;
+}
+
+static int
+ivi_shell_window_list_timer(void *data)
+{
+	struct ivi_compositor *ivi = data;
+
+	ivi_loop_stats_enter(ivi, IVI_LOOP_SOURCE_TIMER);
+	ivi_shell_window_list_flush(ivi);
+	ivi_loop_stats_leave(ivi);
+
+	return 0;
+}
+
+/* Returns false if there is no need to keep track of changes */
+static bool
+ivi_shell_window_list_schedule(struct ivi_compositor *ivi)
+{
+	struct wl_event_loop *loop;
+
+	if (!ivi_shell_has_window_list_clients(ivi))
+		return false;
+
+	if (ivi->window_list.pending)
+		return true;
+
+	if (!ivi->window_list.timer) {
+		loop = wl_display_get_event_loop(ivi->compositor->wl_display);
+		ivi->window_list.timer =
+			wl_event_loop_add_timer(loop,
+						ivi_shell_window_list_timer,
+						ivi);
+	}
+
+	ivi->window_list.pending = true;
+	if (ivi->window_list.timer)
+		wl_event_source_timer_update(ivi->window_list.timer,
+					     IVI_WINDOW_LIST_DELAY_MS);
+
+	return true;
+}
+
+/* For a new app_id, or when activated on another output */
+void
+ivi_shell_toplevel_changed(struct ivi_surface *surface)
+{
+	struct ivi_compositor *ivi = surface->ivi;
+	struct wl_resource *resource;
+
+	wl_resource_for_each(resource, &ivi->shell_client.resources)
+		if (wl_resource_get_version(resource) ==
+		    AGL_SHELL_TOPLEVEL_SINCE_VERSION)
+			shell_send_toplevel(resource, surface);
+
+	if (!ivi_shell_window_list_schedule(ivi))
+		return;
+
+	wl_list_remove(&surface->window_list.link);
+	wl_list_insert(ivi->window_list.changed.prev,
+		       &surface->window_list.link);
+}
+
+void
+ivi_shell_toplevel_closed(struct ivi_surface *surface)
+{
+	struct ivi_compositor *ivi = surface->ivi;
+	struct wl_resource *resource;
+	uint32_t *handle;
+
+	wl_resource_for_each(resource, &ivi->shell_client.resources)
+		if (wl_resource_get_version(resource) ==
+		    AGL_SHELL_TOPLEVEL_CLOSED_SINCE_VERSION)
+			agl_shell_send_toplevel_closed(resource,
+						       surface->handle);
+
+	wl_list_remove(&surface->window_list.link);
+	wl_list_init(&surface->window_list.link);
+
+	if (!surface->window_list.announced ||
+	    !ivi_shell_window_list_schedule(ivi))
+		return;
+
+	surface->window_list.announced = false;
+	handle = wl_array_add(&ivi->window_list.closed, sizeof(*handle));
+	if (handle)
+		*handle = surface->handle;
+}
+
+void
+ivi_shell_toplevel_activated(struct ivi_output *output)
+{
+	if (ivi_shell_window_list_schedule(output->ivi))
+		output->window_list_active = true;
+}
+
+static void
+shell_send_active_toplevel(struct wl_resource *resource,
+			   struct ivi_output *output)
+{
+	struct wl_resource *output_res;
+
+	output_res = ivi_shell_output_resource(output,
+					       wl_resource_get_client(resource));
+	if (output_res && output->active)
+		agl_shell_send_active_toplevel(resource, output_res,
+					       output->active->handle);
+}
+
+/* Sends the changes collected so far to the version 5 clients */
+void
+ivi_shell_window_list_flush(struct ivi_compositor *ivi)
+{
+	struct wl_resource *resource;
+	struct ivi_surface *surface, *tmp;
+	struct ivi_output *output;
+	uint32_t *handle;
+
+	if (!ivi->window_list.pending)
+		return;
+
+	ivi->window_list.pending = false;
+	if (ivi->window_list.timer)
+		wl_event_source_timer_update(ivi->window_list.timer, 0);
+
+	wl_resource_for_each(resource, &ivi->shell_client.resources) {
+		if (wl_resource_get_version(resource) <
+		    AGL_SHELL_WINDOW_LIST_DONE_SINCE_VERSION)
+			continue;
+
+		wl_array_for_each(handle, &ivi->window_list.closed)
+			agl_shell_send_toplevel_closed(resource, *handle);
+
+		wl_list_for_each(surface, &ivi->window_list.changed,
+				 window_list.link)
+			shell_send_toplevel(resource, surface);
+
+		wl_list_for_each(output, &ivi->outputs, link)
+			if (output->window_list_active)
+				shell_send_active_toplevel(resource, output);
+
+		agl_shell_send_window_list_done(resource);
+	}
+
+	ivi->window_list.closed.size = 0;
+
+	wl_list_for_each_safe(surface, tmp, &ivi->window_list.changed,
+			      window_list.link) {
+		surface->window_list.announced = true;
+		wl_list_remove(&surface->window_list.link);
+		wl_list_init(&surface->window_list.link);
+	}
+
+	wl_list_for_each(output, &ivi->outputs, link)
+		output->window_list_active = false;
+}
+
+static void
+shell_ready(struct wl_client *client, struct wl_resource *shell_res)
+{
+	struct ivi_compositor *ivi = wl_resource_get_user_data(shell_res);
+	struct ivi_shell_client *shell_client = ivi_shell_client_from_wl(client);
+
+	if (shell_client) {
+		shell_client->ready = true;
+		weston_log("Shell client '%s' is ready\n",
+			   shell_client->command);
+		ivi_startup_instant(ivi, "ready %s", shell_client->command);
+	}
+
+	ivi_debug(ivi, IVI_DEBUG_SHELL, "ready from client %p\n", client);
+
+	ivi->shell_client.ready_requested = true;
+	ivi_shell_check_ready(ivi);
+}
+
 static void
 shell_set_background(struct wl_client *client,
 		     struct wl_resource *shell_res,
@@ -325,12 +813,14 @@ shell_set_background(struct wl_client *client,
 		return;
 	}
 
-	surface->role = IVI_SURFACE_ROLE_BACKGROUND;
+	ivi_surface_set_role(surface, IVI_SURFACE_ROLE_BACKGROUND);
 	surface->bg.output = output;
 	wl_list_remove(&surface->link);
 	wl_list_init(&surface->link);
 
 	output->background = surface;
+	ivi_debug(output->ivi, IVI_DEBUG_SHELL, "background set on output %s\n",
+		  output->name);
 
 	weston_desktop_surface_set_maximized(dsurface, true);
 	weston_desktop_surface_set_size(dsurface,
@@ -397,13 +887,15 @@ shell_set_panel(struct wl_client *client,
 		return;
 	}
 
-	surface->role = IVI_SURFACE_ROLE_PANEL;
+	ivi_surface_set_role(surface, IVI_SURFACE_ROLE_PANEL);
 	surface->panel.output = output;
 	surface->panel.edge = edge;
 	wl_list_remove(&surface->link);
 	wl_list_init(&surface->link);
 
 	*member = surface;
+	ivi_debug(output->ivi, IVI_DEBUG_SHELL,
+		  "panel with edge %u set on output %s\n", edge, output->name);
 
 	switch (surface->panel.edge) {
 	case AGL_SHELL_EDGE_TOP:
@@ -429,7 +921,260 @@ shell_activate_app(struct wl_client *client,
 	struct weston_output *woutput = weston_head_get_output(head);
 	struct ivi_output *output = to_ivi_output(woutput);
 
-	ivi_layout_activate(output, app_id);
+	ivi_debug(output->ivi, IVI_DEBUG_SHELL, "activate_app %s on output %s\n",
+		  app_id, output->name);
+	ivi_layout_queue_activate(output, app_id);
+}
+
+static void
+shell_activate_handle(struct wl_client *client,
+		      struct wl_resource *shell_res,
+		      uint32_t handle,
+		      struct wl_resource *output_res)
+{
+	struct weston_head *head = weston_head_from_resource(output_res);
+	struct weston_output *woutput = weston_head_get_output(head);
+	struct ivi_output *output = to_ivi_output(woutput);
+
+	ivi_debug(output->ivi, IVI_DEBUG_SHELL,
+		  "activate_handle %u on output %s\n", handle, output->name);
+	ivi_layout_queue_activate_handle(output, handle);
+}
+
+struct ivi_shell_transaction {
+	struct wl_resource *resource;
+	/* NULL once applied */
+	struct ivi_layout_transaction *layout;
+	bool committed;
+};
+
+static bool
+transaction_check_committed(struct wl_resource *resource)
+{
+	struct ivi_shell_transaction *transaction =
+		wl_resource_get_user_data(resource);
+
+	if (!transaction->committed)
+		return false;
+
+	wl_resource_post_error(resource,
+			       AGL_SHELL_TRANSACTION_ERROR_ALREADY_COMMITTED,
+			       "transaction already committed");
+	return true;
+}
+
+/*
+ * Unlike with agl_shell.set_background and set_panel, toplevels not shown at
+ * the moment are fine too, as there are no other surfaces once the shell
+ * client is ready.
+ */
+static struct ivi_surface *
+transaction_get_surface(struct wl_resource *resource,
+			struct wl_resource *surface_res)
+{
+	struct weston_surface *wsurface = wl_resource_get_user_data(surface_res);
+	struct weston_desktop_surface *dsurface;
+	struct ivi_surface *surface;
+	struct ivi_output *output;
+
+	if (transaction_check_committed(resource))
+		return NULL;
+
+	dsurface = weston_surface_get_desktop_surface(wsurface);
+	if (!dsurface) {
+		wl_resource_post_error(resource,
+				       AGL_SHELL_TRANSACTION_ERROR_INVALID_ARGUMENT,
+				       "surface must be a desktop surface");
+		return NULL;
+	}
+
+	surface = weston_desktop_surface_get_user_data(dsurface);
+	if (surface->role != IVI_SURFACE_ROLE_NONE &&
+	    surface->role != IVI_SURFACE_ROLE_DESKTOP) {
+		wl_resource_post_error(resource,
+				       AGL_SHELL_TRANSACTION_ERROR_INVALID_ARGUMENT,
+				       "surface already has another ivi role");
+		return NULL;
+	}
+
+	if (surface->transaction) {
+		wl_resource_post_error(resource,
+				       AGL_SHELL_TRANSACTION_ERROR_INVALID_ARGUMENT,
+				       "surface already part of a transaction");
+		return NULL;
+	}
+
+	wl_list_for_each(output, &surface->ivi->outputs, link) {
+		if (output->active == surface) {
+			wl_resource_post_error(resource,
+					       AGL_SHELL_TRANSACTION_ERROR_INVALID_ARGUMENT,
+					       "surface is an active application");
+			return NULL;
+		}
+	}
+
+	return surface;
+}
+
+static void
+transaction_destroy(struct wl_client *client, struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static void
+transaction_set_background(struct wl_client *client,
+			   struct wl_resource *resource,
+			   struct wl_resource *surface_res,
+			   struct wl_resource *output_res)
+{
+	struct ivi_shell_transaction *transaction =
+		wl_resource_get_user_data(resource);
+	struct weston_head *head = weston_head_from_resource(output_res);
+	struct weston_output *woutput = weston_head_get_output(head);
+	struct ivi_output *output = to_ivi_output(woutput);
+	struct ivi_surface *surface;
+
+	surface = transaction_get_surface(resource, surface_res);
+	if (!surface)
+		return;
+
+	if (ivi_layout_transaction_set_background(transaction->layout,
+						  output, surface) < 0)
+		wl_client_post_no_memory(client);
+}
+
+static void
+transaction_set_panel(struct wl_client *client,
+		      struct wl_resource *resource,
+		      struct wl_resource *surface_res,
+		      struct wl_resource *output_res,
+		      uint32_t edge)
+{
+	struct ivi_shell_transaction *transaction =
+		wl_resource_get_user_data(resource);
+	struct weston_head *head = weston_head_from_resource(output_res);
+	struct weston_output *woutput = weston_head_get_output(head);
+	struct ivi_output *output = to_ivi_output(woutput);
+	struct ivi_surface *surface;
+
+	surface = transaction_get_surface(resource, surface_res);
+	if (!surface)
+		return;
+
+	if (edge > AGL_SHELL_EDGE_RIGHT) {
+		wl_resource_post_error(resource,
+				       AGL_SHELL_TRANSACTION_ERROR_INVALID_ARGUMENT,
+				       "invalid edge for panel");
+		return;
+	}
+
+	if (ivi_layout_transaction_set_panel(transaction->layout, output,
+					     surface, edge) < 0)
+		wl_client_post_no_memory(client);
+}
+
+static void
+transaction_activate_app(struct wl_client *client,
+			 struct wl_resource *resource,
+			 const char *app_id,
+			 struct wl_resource *output_res)
+{
+	struct ivi_shell_transaction *transaction =
+		wl_resource_get_user_data(resource);
+	struct weston_head *head = weston_head_from_resource(output_res);
+	struct weston_output *woutput = weston_head_get_output(head);
+	struct ivi_output *output = to_ivi_output(woutput);
+
+	if (transaction_check_committed(resource))
+		return;
+
+	if (ivi_layout_transaction_activate(transaction->layout, output,
+					    app_id) < 0)
+		wl_client_post_no_memory(client);
+}
+
+static void
+transaction_commit(struct wl_client *client, struct wl_resource *resource)
+{
+	struct ivi_shell_transaction *transaction =
+		wl_resource_get_user_data(resource);
+
+	if (transaction_check_committed(resource))
+		return;
+
+	transaction->committed = true;
+	ivi_layout_transaction_commit(transaction->layout);
+}
+
+static const struct agl_shell_transaction_interface agl_shell_transaction_implementation = {
+	.destroy = transaction_destroy,
+	.set_background = transaction_set_background,
+	.set_panel = transaction_set_panel,
+	.activate_app = transaction_activate_app,
+	.commit = transaction_commit,
+};
+
+static void
+transaction_done(void *data)
+{
+	struct ivi_shell_transaction *transaction = data;
+
+	transaction->layout = NULL;
+	agl_shell_transaction_send_done(transaction->resource);
+}
+
+static void
+transaction_resource_destroyed(struct wl_resource *resource)
+{
+	struct ivi_shell_transaction *transaction =
+		wl_resource_get_user_data(resource);
+
+	if (transaction->layout)
+		ivi_layout_transaction_destroy(transaction->layout);
+	free(transaction);
+}
+
+static void
+shell_create_transaction(struct wl_client *client,
+			 struct wl_resource *shell_res,
+			 uint32_t id)
+{
+	struct ivi_compositor *ivi = wl_resource_get_user_data(shell_res);
+	struct ivi_shell_transaction *transaction;
+
+	transaction = zalloc(sizeof(*transaction));
+	if (!transaction) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	transaction->resource =
+		wl_resource_create(client, &agl_shell_transaction_interface,
+				   wl_resource_get_version(shell_res), id);
+	if (!transaction->resource) {
+		free(transaction);
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	transaction->layout = ivi_layout_transaction_create(ivi,
+							    transaction_done,
+							    transaction);
+	if (!transaction->layout) {
+		wl_resource_destroy(transaction->resource);
+		free(transaction);
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(transaction->resource,
+				       &agl_shell_transaction_implementation,
+				       transaction,
+				       transaction_resource_destroyed);
+
+	ivi_debug(ivi, IVI_DEBUG_SHELL, "transaction %p created\n",
+		  transaction);
 }
 
 static const struct agl_shell_interface agl_shell_implementation = {
@@ -437,45 +1182,112 @@ static const struct agl_shell_interface agl_shell_implementation = {
 	.set_background = shell_set_background,
 	.set_panel = shell_set_panel,
 	.activate_app = shell_activate_app,
+	.create_transaction = shell_create_transaction,
+	.activate_handle = shell_activate_handle,
 };
 
+static bool
+ivi_surface_is_from_client(struct ivi_surface *surface, struct wl_client *client)
+{
+	struct weston_desktop_client *dclient;
+
+	if (!surface)
+		return false;
+
+	dclient = weston_desktop_surface_get_client(surface->dsurface);
+	return weston_desktop_client_get_client(dclient) == client;
+}
+
+/*
+ * Takes a background or panel of a departing shell client off its output.
+ * The ivi_surface stays with its desktop surface, desktop_surface_removed()
+ * frees it.
+ */
+static void
+ivi_shell_drop_surface(struct ivi_surface **member, struct wl_client *client)
+{
+	struct ivi_surface *surface = *member;
+	struct weston_view *view;
+
+	if (!ivi_surface_is_from_client(surface, client))
+		return;
+
+	view = surface->view;
+	if (weston_view_is_mapped(view)) {
+		ivi_layer_remove(view);
+		view->is_mapped = false;
+		view->surface->is_mapped = false;
+	}
+
+	if (surface->role == IVI_SURFACE_ROLE_BACKGROUND)
+		surface->bg.output = NULL;
+	else
+		surface->panel.output = NULL;
+
+	ivi_surface_set_role(surface, IVI_SURFACE_ROLE_NONE);
+	*member = NULL;
+}
+
 static void
 unbind_agl_shell(struct wl_resource *resource)
 {
 	struct ivi_compositor *ivi;
 	struct ivi_output *output;
 	struct ivi_surface *surf, *surf_tmp;
+	struct ivi_shell_client *shell_client, *found = NULL;
+	struct wl_client *client = wl_resource_get_client(resource);
+	bool required;
 
 	ivi = wl_resource_get_user_data(resource);
-	wl_list_for_each(output, &ivi->outputs, link) {
-		free(output->background);
-		output->background = NULL;
+	wl_list_remove(wl_resource_get_link(resource));
 
-		free(output->top);
-		output->top = NULL;
+	/* the client might be going away, look it up by its resource */
+	wl_list_for_each(shell_client, &ivi->shell_client.clients, link) {
+		if (shell_client->resource == resource) {
+			shell_client->resource = NULL;
+			found = shell_client;
+		}
+	}
 
-		free(output->bottom);
-		output->bottom = NULL;
+	/*
+	 * Losing a client we had to wait for brings back the state from
+	 * before it was ready, otherwise only its own surfaces go away.
+	 */
+	if (found)
+		required = found->require_ready;
+	else
+		required = !ivi_shell_has_required_clients(ivi);
+
+	wl_list_for_each(output, &ivi->outputs, link) {
+		ivi_shell_drop_surface(&output->background, client);
+		if (!output->background)
+			output->background_occluded = false;
 
-		free(output->left);
-		output->left = NULL;
+		ivi_shell_drop_surface(&output->top, client);
+		ivi_shell_drop_surface(&output->bottom, client);
+		ivi_shell_drop_surface(&output->left, client);
+		ivi_shell_drop_surface(&output->right, client);
 
-		free(output->right);
-		output->right = NULL;
+		if (!required)
+			continue;
 
 		/* reset the active surf if there's one present */
 		if (output->active) {
 			output->active->view->is_mapped = false;
 			output->active->view->surface->is_mapped = false;
 
-			weston_layer_entry_remove(&output->active->view->layer_link);
+			ivi_layer_remove(output->active->view);
 			output->active = NULL;
 		}
 
 		insert_black_surface(output);
 	}
 
+	if (!required)
+		return;
+
 	wl_list_for_each_safe(surf, surf_tmp, &ivi->surfaces, link) {
+		ivi_layout_remove_app_id(surf);
 		wl_list_remove(&surf->link);
 		wl_list_init(&surf->link);
 	}
@@ -489,8 +1301,9 @@ unbind_agl_shell(struct wl_resource *resource)
 	wl_list_init(&ivi->pending_surfaces);
 
 	ivi->shell_client.ready = false;
-	ivi->shell_client.resource = NULL;
-	ivi->shell_client.client = NULL;
+	ivi->shell_client.ready_requested = false;
+	if (found)
+		found->ready = false;
 }
 
 static void
@@ -498,39 +1311,70 @@ bind_agl_shell(struct wl_client *client,
 	       void *data, uint32_t version, uint32_t id)
 {
 	struct ivi_compositor *ivi = data;
+	struct ivi_shell_client *shell_client;
 	struct wl_resource *resource;
 
 	resource = wl_resource_create(client, &agl_shell_interface,
-				      1, id);
+				      MIN(version, 5), id);
 	if (!resource) {
 		wl_client_post_no_memory(client);
 		return;
 	}
 
+	shell_client = ivi_shell_client_from_wl(client);
 #if 0
-	if (ivi->shell_client.client != client) {
+	if (!shell_client) {
 		wl_resource_post_error(resource, WL_DISPLAY_ERROR_INVALID_OBJECT,
 				       "client not authorized to use agl_shell");
 		return;
 	}
 #endif
 
-	if (ivi->shell_client.resource) {
+	if (wl_resource_find_for_client(&ivi->shell_client.resources, client)) {
 		wl_resource_post_error(resource, WL_DISPLAY_ERROR_INVALID_OBJECT,
 				       "agl_shell has already been bound");
 		return;
 	}
 
+	/* the others are up to date before the snapshot goes out */
+	ivi_shell_window_list_flush(ivi);
+
 	wl_resource_set_implementation(resource, &agl_shell_implementation,
 				       ivi, unbind_agl_shell);
-	ivi->shell_client.resource = resource;
+	wl_list_insert(&ivi->shell_client.resources,
+		       wl_resource_get_link(resource));
+
+	if (shell_client)
+		shell_client->resource = resource;
+
+	/* the toplevels are only announced when they change otherwise */
+	if (wl_resource_get_version(resource) >=
+	    AGL_SHELL_TOPLEVEL_SINCE_VERSION) {
+		struct ivi_surface *surface;
+		struct ivi_output *output;
+
+		wl_list_for_each(surface, &ivi->surfaces, link) {
+			if (!surface->app_id)
+				continue;
+
+			shell_send_toplevel(resource, surface);
+			surface->window_list.announced = true;
+		}
+
+		if (wl_resource_get_version(resource) >=
+		    AGL_SHELL_WINDOW_LIST_DONE_SINCE_VERSION) {
+			wl_list_for_each(output, &ivi->outputs, link)
+				shell_send_active_toplevel(resource, output);
+			agl_shell_send_window_list_done(resource);
+		}
+	}
 }
 
 int
 ivi_shell_create_global(struct ivi_compositor *ivi)
 {
 	ivi->agl_shell = wl_global_create(ivi->compositor->wl_display,
-					  &agl_shell_interface, 1,
+					  &agl_shell_interface, 5,
 					  ivi, bind_agl_shell);
 	if (!ivi->agl_shell) {
 		weston_log("Failed to create wayland global.\n");
@@ -0,0 +1,452 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Splash screen shown on top of the black surface until the shell client is
+ * ready, so that something meaningful is on screen without waiting for the
+ * shell client to start up.
+ *
+ * The image is given with 'splash' (or 'background-image') in the [output]
+ * section and is expected to be already decoded, in the raw format described
+ * in shared/splash.h, which agl-compositor-splash-convert makes out of PNG
+ * files. The image is centered on the output.
+ *
+ * libweston only takes buffers from clients, so the compositor connects to
+ * itself through a socketpair and attaches the images as wl_shm buffers,
+ * then puts the views of these surfaces in the fullscreen layer.
+ */
+
+#include "ivi-compositor.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <wayland-client.h>
+#include <libweston-6/compositor.h>
+#include <libweston-6/config-parser.h>
+
+#include "shared/os-compatibility.h"
+#include "shared/splash.h"
+
+struct ivi_splash_image {
+	struct wl_list link;	/* ivi_splash.images */
+	struct ivi_output *output;
+
+	int fd;			/* header and pixels, copied */
+	size_t size;
+	struct splash_header header;
+
+	struct wl_buffer *buffer;
+	struct wl_surface *surface;
+	struct weston_view *view;
+};
+
+struct ivi_splash {
+	struct ivi_compositor *ivi;
+
+	/* our end, as seen by the compositor */
+	struct wl_client *client;
+
+	/* our end, as a client */
+	struct wl_display *display;
+	struct wl_registry *registry;
+	struct wl_compositor *compositor;
+	struct wl_shm *shm;
+	struct wl_callback *sync;
+	struct wl_event_source *source;
+
+	struct wl_list images;
+};
+
+static void
+ivi_splash_image_destroy(struct ivi_splash_image *image)
+{
+	if (image->surface)
+		wl_surface_destroy(image->surface);
+	if (image->buffer)
+		wl_buffer_destroy(image->buffer);
+	if (image->fd >= 0)
+		close(image->fd);
+	wl_list_remove(&image->link);
+	free(image);
+}
+
+static struct ivi_splash_image *
+ivi_splash_image_load(struct ivi_output *output, const char *path)
+{
+	struct ivi_splash_image *image;
+	struct splash_header *header;
+	struct stat st;
+	void *src = MAP_FAILED, *dst;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		weston_log("Failed to open splash image %s: %s\n",
+			   path, strerror(errno));
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(*header))
+		goto err_format;
+
+	src = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (src == MAP_FAILED)
+		goto err_format;
+
+	header = src;
+	if (memcmp(header->magic, SPLASH_MAGIC, sizeof(header->magic)) ||
+	    header->width == 0 || header->height == 0 ||
+	    header->width > INT32_MAX / 4 ||
+	    header->stride < header->width * 4 ||
+	    (header->format != SPLASH_FORMAT_ARGB8888 &&
+	     header->format != SPLASH_FORMAT_XRGB8888) ||
+	    (uint64_t) header->stride * header->height >
+	    (uint64_t) st.st_size - sizeof(*header) ||
+	    st.st_size > INT32_MAX)
+		goto err_format;
+
+	image = zalloc(sizeof(*image));
+	if (!image)
+		goto err_unmap;
+
+	image->output = output;
+	image->fd = -1;
+	image->header = *header;
+	image->size = st.st_size;
+	wl_list_init(&image->link);
+
+	/*
+	 * wl_shm maps pools writable and shared, which the image file might
+	 * not allow, so hand out a copy.
+	 */
+	image->fd = os_create_anonymous_file(image->size);
+	if (image->fd < 0)
+		goto err_image;
+
+	dst = mmap(NULL, image->size, PROT_WRITE, MAP_SHARED, image->fd, 0);
+	if (dst == MAP_FAILED)
+		goto err_image;
+
+	memcpy(dst, src, image->size);
+	munmap(dst, image->size);
+	munmap(src, st.st_size);
+	close(fd);
+
+	return image;
+
+err_image:
+	ivi_splash_image_destroy(image);
+err_unmap:
+	munmap(src, st.st_size);
+	close(fd);
+	weston_log("Failed to load splash image %s: %s\n",
+		   path, strerror(errno));
+	return NULL;
+
+err_format:
+	if (src != MAP_FAILED)
+		munmap(src, st.st_size);
+	close(fd);
+	weston_log("Splash image %s is not in the expected format\n", path);
+	return NULL;
+}
+
+static void
+ivi_splash_show(struct ivi_splash *splash, struct ivi_splash_image *image)
+{
+	struct ivi_compositor *ivi = splash->ivi;
+	struct weston_output *woutput = image->output->output;
+	struct weston_surface *surface;
+	struct wl_resource *resource;
+	uint32_t id;
+
+	if (!woutput)
+		return;
+
+	/* the compositor has handled our requests by now */
+	id = wl_proxy_get_id((struct wl_proxy *) image->surface);
+	resource = wl_client_get_object(splash->client, id);
+	if (!resource)
+		return;
+
+	surface = wl_resource_get_user_data(resource);
+	image->view = weston_view_create(surface);
+	if (!image->view)
+		return;
+
+	weston_view_set_output(image->view, woutput);
+	weston_view_set_position(image->view,
+				 woutput->x + (woutput->width -
+					       (int32_t) image->header.width) / 2,
+				 woutput->y + (woutput->height -
+					       (int32_t) image->header.height) / 2);
+	ivi_layer_insert(&ivi->fullscreen, image->view);
+
+	surface->is_mapped = true;
+	image->view->is_mapped = true;
+
+	weston_view_update_transform(image->view);
+	ivi_layout_damage_view(ivi, image->view);
+}
+
+static void
+splash_surfaces_done(void *data, struct wl_callback *callback, uint32_t serial)
+{
+	struct ivi_splash *splash = data;
+	struct ivi_splash_image *image;
+
+	wl_callback_destroy(callback);
+	splash->sync = NULL;
+
+	wl_list_for_each(image, &splash->images, link)
+		ivi_splash_show(splash, image);
+}
+
+static const struct wl_callback_listener splash_surfaces_listener = {
+	splash_surfaces_done,
+};
+
+static void
+splash_registry_done(void *data, struct wl_callback *callback, uint32_t serial)
+{
+	struct ivi_splash *splash = data;
+	struct ivi_splash_image *image;
+
+	wl_callback_destroy(callback);
+	splash->sync = NULL;
+
+	if (!splash->compositor || !splash->shm) {
+		weston_log("Splash: missing wl_compositor or wl_shm\n");
+		return;
+	}
+
+	wl_list_for_each(image, &splash->images, link) {
+		struct splash_header *header = &image->header;
+		struct wl_shm_pool *pool;
+
+		pool = wl_shm_create_pool(splash->shm, image->fd, image->size);
+		image->buffer =
+			wl_shm_pool_create_buffer(pool, sizeof(*header),
+						  header->width, header->height,
+						  header->stride, header->format);
+		wl_shm_pool_destroy(pool);
+
+		close(image->fd);
+		image->fd = -1;
+
+		image->surface = wl_compositor_create_surface(splash->compositor);
+		wl_surface_attach(image->surface, image->buffer, 0, 0);
+		wl_surface_damage(image->surface, 0, 0,
+				  header->width, header->height);
+		wl_surface_commit(image->surface);
+	}
+
+	splash->sync = wl_display_sync(splash->display);
+	wl_callback_add_listener(splash->sync, &splash_surfaces_listener, splash);
+}
+
+static const struct wl_callback_listener splash_registry_listener = {
+	splash_registry_done,
+};
+
+static void
+registry_handle_global(void *data, struct wl_registry *registry, uint32_t name,
+		       const char *interface, uint32_t version)
+{
+	struct ivi_splash *splash = data;
+
+	if (strcmp(interface, "wl_compositor") == 0)
+		splash->compositor =
+			wl_registry_bind(registry, name,
+					 &wl_compositor_interface, 1);
+	else if (strcmp(interface, "wl_shm") == 0)
+		splash->shm = wl_registry_bind(registry, name,
+					       &wl_shm_interface, 1);
+}
+
+static void
+registry_handle_global_remove(void *data, struct wl_registry *registry,
+			      uint32_t name)
+{
+}
+
+static const struct wl_registry_listener registry_listener = {
+	registry_handle_global,
+	registry_handle_global_remove,
+};
+
+static int
+splash_handle_event(int fd, uint32_t mask, void *data)
+{
+	struct ivi_splash *splash = data;
+	struct ivi_compositor *ivi = splash->ivi;
+
+	ivi_loop_stats_enter(ivi, IVI_LOOP_SOURCE_FD);
+
+	if (mask & (WL_EVENT_HANGUP | WL_EVENT_ERROR) ||
+	    wl_display_dispatch(splash->display) < 0) {
+		weston_log("Splash: lost the connection to the compositor\n");
+		wl_event_source_remove(splash->source);
+		splash->source = NULL;
+	} else {
+		wl_display_flush(splash->display);
+	}
+
+	ivi_loop_stats_leave(ivi);
+
+	return 0;
+}
+
+void
+ivi_splash_init(struct ivi_compositor *ivi)
+{
+	struct wl_event_loop *loop =
+		wl_display_get_event_loop(ivi->compositor->wl_display);
+	struct ivi_splash *splash;
+	struct ivi_output *output;
+	int sv[2];
+
+	splash = zalloc(sizeof(*splash));
+	if (!splash)
+		return;
+
+	splash->ivi = ivi;
+	wl_list_init(&splash->images);
+
+	wl_list_for_each(output, &ivi->outputs, link) {
+		struct ivi_splash_image *image;
+		char *path;
+
+		weston_config_section_get_string(output->config, "splash",
+						 &path, NULL);
+		if (!path)
+			weston_config_section_get_string(output->config,
+							 "background-image",
+							 &path, NULL);
+		if (!path)
+			continue;
+
+		image = ivi_splash_image_load(output, path);
+		free(path);
+
+		if (image)
+			wl_list_insert(splash->images.prev, &image->link);
+	}
+
+	if (wl_list_empty(&splash->images)) {
+		free(splash);
+		return;
+	}
+
+	ivi->splash = splash;
+
+	if (os_socketpair_cloexec(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+		goto err;
+
+	splash->client = wl_client_create(ivi->compositor->wl_display, sv[0]);
+	if (!splash->client) {
+		close(sv[0]);
+		close(sv[1]);
+		goto err;
+	}
+	ivi_metrics_client_ignore(ivi, splash->client);
+
+	/* this closes the fd on failure already */
+	splash->display = wl_display_connect_to_fd(sv[1]);
+	if (!splash->display)
+		goto err;
+
+	splash->source = wl_event_loop_add_fd(loop,
+					      wl_display_get_fd(splash->display),
+					      WL_EVENT_READABLE,
+					      splash_handle_event, splash);
+	if (!splash->source)
+		goto err;
+
+	splash->registry = wl_display_get_registry(splash->display);
+	wl_registry_add_listener(splash->registry, &registry_listener, splash);
+
+	splash->sync = wl_display_sync(splash->display);
+	wl_callback_add_listener(splash->sync, &splash_registry_listener, splash);
+
+	wl_display_flush(splash->display);
+
+	return;
+
+err:
+	weston_log("Failed to set up the splash screen: %s\n", strerror(errno));
+	ivi_splash_destroy(ivi);
+}
+
+/*
+ * Takes the splash screen down, once the shell client is ready. The views go
+ * away along with the surfaces of our client.
+ */
+void
+ivi_splash_destroy(struct ivi_compositor *ivi)
+{
+	struct ivi_splash *splash = ivi->splash;
+	struct ivi_splash_image *image, *tmp;
+
+	if (!splash)
+		return;
+
+	wl_list_for_each_safe(image, tmp, &splash->images, link) {
+		if (image->view) {
+			ivi_layout_damage_view(ivi, image->view);
+			ivi_layer_remove(image->view);
+		}
+		ivi_splash_image_destroy(image);
+	}
+
+	if (splash->source)
+		wl_event_source_remove(splash->source);
+
+	if (splash->sync)
+		wl_callback_destroy(splash->sync);
+	if (splash->shm)
+		wl_shm_destroy(splash->shm);
+	if (splash->compositor)
+		wl_compositor_destroy(splash->compositor);
+	if (splash->registry)
+		wl_registry_destroy(splash->registry);
+
+	/* destroys the surfaces, and their views, right away */
+	if (splash->client)
+		wl_client_destroy(splash->client);
+
+	if (splash->display)
+		wl_display_disconnect(splash->display);
+
+	free(splash);
+	ivi->splash = NULL;
+}
@@ -0,0 +1,346 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Start-up trace
+ *
+ * Records how long each phase of the start-up takes, from the exec of the
+ * compositor to the first frame of every output once the shell client is
+ * ready, along with when the shell clients got launched and ready and the
+ * first background got committed. Once all outputs showed such a frame, or
+ * when exiting before that, the trace is written in the Chrome trace event
+ * format, which Perfetto and chrome://tracing load, to the file given by
+ * startup-trace in [core], agl-compositor-startup.json in XDG_RUNTIME_DIR by
+ * default (no file without either), and summed up in one line in the log.
+ *
+ * Times are relative to the exec, which is only known with the resolution
+ * of the kernel clock tick.
+ *
+ * The frame signal of an output is emitted once its repaint got submitted,
+ * so "frame" here is what was handed to the backend rather than what got
+ * scanned out, which is at most a refresh cycle later.
+ */
+
+#include "ivi-compositor.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libweston-6/config-parser.h>
+
+#include "shared/timespec-util.h"
+
+#define IVI_STARTUP_MAX_EVENTS 64
+
+struct ivi_startup_event {
+	char name[64];
+	int64_t start;		/* CLOCK_MONOTONIC, in ns */
+	int64_t end;		/* same as start for instant events */
+};
+
+struct ivi_startup {
+	int64_t exec;
+	int64_t last_phase;
+	int count;
+	struct ivi_startup_event events[IVI_STARTUP_MAX_EVENTS];
+};
+
+static int64_t
+now_nsec(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+
+	return timespec_to_nsec(&ts);
+}
+
+/*
+ * The start time of the process in /proc/self/stat is in clock ticks since
+ * boot, that is CLOCK_BOOTTIME, convert it to CLOCK_MONOTONIC.
+ */
+static int64_t
+exec_time(void)
+{
+	unsigned long long start_ticks;
+	char buf[1024], *p;
+	long ticks = sysconf(_SC_CLK_TCK);
+	int64_t boot_to_mono;
+	FILE *file;
+	size_t len;
+
+	file = fopen("/proc/self/stat", "re");
+	if (!file)
+		return -1;
+
+	len = fread(buf, 1, sizeof(buf) - 1, file);
+	fclose(file);
+	buf[len] = '\0';
+
+	/* the command name can have spaces, skip past it */
+	p = strrchr(buf, ')');
+	if (!p || ticks <= 0)
+		return -1;
+
+	/* starttime is the 22nd field, the 20th after the command name */
+	if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+			  "%*u %*u %*d %*d %*d %*d %*d %*d %llu",
+		   &start_ticks) != 1)
+		return -1;
+
+	boot_to_mono = now_nsec(CLOCK_BOOTTIME) - now_nsec(CLOCK_MONOTONIC);
+
+	return (int64_t) start_ticks * (NSEC_PER_SEC / ticks) - boot_to_mono;
+}
+
+static struct ivi_startup_event *
+ivi_startup_add(struct ivi_startup *startup, int64_t start, int64_t end,
+		const char *fmt, va_list ap)
+{
+	struct ivi_startup_event *event;
+
+	if (startup->count == IVI_STARTUP_MAX_EVENTS)
+		return NULL;
+
+	event = &startup->events[startup->count++];
+	vsnprintf(event->name, sizeof(event->name), fmt, ap);
+	event->start = start;
+	event->end = end;
+
+	return event;
+}
+
+void
+ivi_startup_init(struct ivi_compositor *ivi)
+{
+	struct ivi_startup *startup;
+	int64_t now = now_nsec(CLOCK_MONOTONIC);
+
+	startup = zalloc(sizeof(*startup));
+	if (!startup)
+		return;
+
+	startup->exec = exec_time();
+	if (startup->exec < 0 || startup->exec > now)
+		startup->exec = now;
+	startup->last_phase = now;
+
+	ivi->startup = startup;
+
+	ivi_startup_span(ivi, startup->exec, now, "exec");
+}
+
+/* A phase of main(), from the end of the previous one until now */
+void
+ivi_startup_phase(struct ivi_compositor *ivi, const char *name)
+{
+	struct ivi_startup *startup = ivi->startup;
+	int64_t now;
+
+	if (!startup)
+		return;
+
+	now = now_nsec(CLOCK_MONOTONIC);
+	ivi_startup_span(ivi, startup->last_phase, now, "%s", name);
+	startup->last_phase = now;
+}
+
+void
+ivi_startup_span(struct ivi_compositor *ivi, int64_t start, int64_t end,
+		 const char *fmt, ...)
+{
+	va_list ap;
+
+	if (!ivi->startup)
+		return;
+
+	va_start(ap, fmt);
+	ivi_startup_add(ivi->startup, start, end, fmt, ap);
+	va_end(ap);
+}
+
+void
+ivi_startup_instant(struct ivi_compositor *ivi, const char *fmt, ...)
+{
+	int64_t now;
+	va_list ap;
+
+	if (!ivi->startup)
+		return;
+
+	now = now_nsec(CLOCK_MONOTONIC);
+
+	va_start(ap, fmt);
+	ivi_startup_add(ivi->startup, now, now, fmt, ap);
+	va_end(ap);
+}
+
+/* Prints 'name' as a JSON string */
+static void
+json_string(FILE *file, const char *name)
+{
+	fputc('"', file);
+	for (const char *p = name; *p; p++) {
+		if (*p == '"' || *p == '\\')
+			fprintf(file, "\\%c", *p);
+		else if ((unsigned char) *p < 0x20)
+			fprintf(file, "\\u%04x", *p);
+		else
+			fputc(*p, file);
+	}
+	fputc('"', file);
+}
+
+static void
+ivi_startup_write_trace(struct ivi_compositor *ivi, struct ivi_startup *startup)
+{
+	struct weston_config_section *section;
+	const char *dir;
+	char *path;
+	FILE *file;
+	pid_t pid = getpid();
+
+	section = weston_config_get_section(ivi->config, "core", NULL, NULL);
+	weston_config_section_get_string(section, "startup-trace", &path, NULL);
+	if (!path) {
+		/* not a fixed name in /tmp, which anyone could plant a link at */
+		dir = getenv("XDG_RUNTIME_DIR");
+		if (!dir || asprintf(&path, "%s/agl-compositor-startup.json",
+				     dir) < 0)
+			return;
+	}
+
+	file = fopen(path, "we");
+	if (!file) {
+		weston_log("Failed to write the start-up trace to %s: %s\n",
+			   path, strerror(errno));
+		free(path);
+		return;
+	}
+
+	fprintf(file, "{\"traceEvents\":[\n");
+	for (int i = 0; i < startup->count; i++) {
+		struct ivi_startup_event *event = &startup->events[i];
+		int64_t ts = (event->start - startup->exec) / 1000;
+
+		fprintf(file, "{\"name\":");
+		json_string(file, event->name);
+		if (event->end != event->start)
+			fprintf(file, ",\"ph\":\"X\",\"dur\":%" PRId64,
+				(event->end - event->start) / 1000);
+		else
+			fprintf(file, ",\"ph\":\"i\",\"s\":\"g\"");
+		fprintf(file, ",\"ts\":%" PRId64 ",\"pid\":%d,\"tid\":%d}%s\n",
+			ts, pid, pid, i + 1 < startup->count ? "," : "");
+	}
+	fprintf(file, "],\"displayTimeUnit\":\"ms\"}\n");
+	fclose(file);
+
+	weston_log("Start-up trace written to %s\n", path);
+	free(path);
+}
+
+/* One line with the time each event ended at, in ms since the exec */
+void
+ivi_startup_summary(struct ivi_compositor *ivi, char *buf, size_t size)
+{
+	struct ivi_startup *startup = ivi->startup;
+	size_t len = 0;
+
+	snprintf(buf, size, "nothing");
+	if (!startup)
+		return;
+
+	for (int i = 0; i < startup->count && len < size; i++) {
+		struct ivi_startup_event *event = &startup->events[i];
+
+		len += snprintf(buf + len, size - len,
+				"%s%s %" PRId64 "ms", i ? ", " : "",
+				event->name,
+				(event->end - startup->exec) / 1000000);
+	}
+}
+
+/* Writes the trace and log summary, and stops recording */
+void
+ivi_startup_finish(struct ivi_compositor *ivi)
+{
+	struct ivi_startup *startup = ivi->startup;
+	char summary[1024];
+
+	if (!startup)
+		return;
+
+	ivi_startup_summary(ivi, summary, sizeof(summary));
+	ivi->startup = NULL;
+
+	weston_log("Start-up: %s\n", summary);
+
+	ivi_startup_write_trace(ivi, startup);
+	free(startup);
+}
+
+/*
+ * Called on every repaint of an output, until the start-up is done. The
+ * first frame after the shell client is ready is the one that matters: the
+ * start-up is complete once all outputs got there, at which point
+ * first_frame_signal is emitted and the trace written.
+ */
+void
+ivi_startup_output_frame(struct ivi_output *output)
+{
+	struct ivi_compositor *ivi = output->ivi;
+	struct ivi_output *iter;
+
+	if (ivi->first_frame_done)
+		return;
+
+	if (!output->startup_frame) {
+		output->startup_frame = true;
+		ivi_startup_instant(ivi, "first frame %s", output->name);
+	}
+
+	if (!ivi->shell_client.ready || output->startup_ready_frame)
+		return;
+
+	output->startup_ready_frame = true;
+	ivi_startup_instant(ivi, "ready frame %s", output->name);
+
+	wl_list_for_each(iter, &ivi->outputs, link)
+		if (iter->output && iter->output->enabled &&
+		    !iter->startup_ready_frame)
+			return;
+
+	ivi->first_frame_done = true;
+	wl_signal_emit(&ivi->first_frame_signal, ivi);
+
+	ivi_startup_finish(ivi);
+}
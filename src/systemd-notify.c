@@ -24,21 +24,56 @@
  * SOFTWARE.
  */
 
+/*
+ * READY=1 is sent to systemd right after the shell clients got launched by
+ * default. With notify-ready=first-frame in [core] it is only sent once the
+ * shell client is ready and every output showed a frame with it, or after
+ * notify-ready-timeout milliseconds (10 seconds by default) if that takes
+ * too long, so that services ordered after the compositor don't compete with
+ * the start-up of the UI. STATUS= then carries the start-up timings.
+ *
+ * When the service has a WatchdogSec, WATCHDOG=1 is only sent if the event
+ * loop dispatched the watchdog timer no later than watchdog-max-lag
+ * milliseconds after it was due, and no enabled output has been waiting for
+ * longer than watchdog-frame-timeout milliseconds for a repaint to complete,
+ * both 1 second by default. Otherwise STATUS= tells why the ping was held.
+ */
+
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include <assert.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <time.h>
 
 #include <systemd/sd-daemon.h>
 #include <sys/socket.h>
 #include <wayland-server.h>
 
+#include <libweston-6/config-parser.h>
+
 #include "ivi-compositor.h"
 #include "shared/helpers.h"
+#include "shared/timespec-util.h"
+
+#define NOTIFY_READY_TIMEOUT_DEFAULT 10000
+#define WATCHDOG_FRAME_TIMEOUT_DEFAULT 1000
+#define WATCHDOG_MAX_LAG_DEFAULT 1000
 
 struct systemd_notifier {
+	struct ivi_compositor *ivi;
 	int watchdog_time;
 	struct wl_event_source *watchdog_source;
+	struct timespec watchdog_due;
+	int32_t watchdog_frame_timeout;	/* ms */
+	int32_t watchdog_max_lag;	/* ms */
+	bool watchdog_held;
 	struct wl_listener compositor_destroy_listener;
+
+	/* only used with notify-ready=first-frame, until READY=1 is sent */
+	struct wl_listener first_frame_listener;
+	struct wl_event_source *ready_timeout_source;
 };
 
 static inline bool
@@ -109,19 +144,131 @@ add_systemd_sockets(struct weston_compositor *compositor)
 	return current_fd;
 }
 
+static void
+watchdog_arm(struct systemd_notifier *notifier)
+{
+	clock_gettime(CLOCK_MONOTONIC, &notifier->watchdog_due);
+	timespec_add_msec(&notifier->watchdog_due, &notifier->watchdog_due,
+			  notifier->watchdog_time);
+
+	wl_event_source_timer_update(notifier->watchdog_source,
+			notifier->watchdog_time);
+}
+
+/*
+ * An output is stuck if it had a repaint pending at the previous check
+ * already, has one now, completed none in between, and the last one
+ * completed longer than watchdog_frame_timeout ago. Idle outputs are fine.
+ */
+static bool
+watchdog_output_stuck(struct systemd_notifier *notifier,
+		      struct ivi_output *output, const struct timespec *now)
+{
+	bool busy = output->output->repaint_status != REPAINT_NOT_SCHEDULED;
+	bool stuck = busy && output->frames.checked_busy &&
+		     output->frames.checked_count == output->frames.count &&
+		     timespec_sub_to_msec(now, &output->frames.last) >
+		     notifier->watchdog_frame_timeout;
+
+	output->frames.checked_busy = busy;
+	output->frames.checked_count = output->frames.count;
+
+	return stuck;
+}
+
 static int
 watchdog_handler(void *data)
 {
 	struct systemd_notifier *notifier = data;
+	struct ivi_output *output;
+	struct timespec now;
+	char reason[256] = "";
+	int64_t lag;
+
+	ivi_loop_stats_enter(notifier->ivi, IVI_LOOP_SOURCE_TIMER);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	lag = timespec_sub_to_msec(&now, &notifier->watchdog_due);
+
+	if (lag > notifier->watchdog_max_lag)
+		snprintf(reason, sizeof(reason),
+			 "event loop dispatch lagging by %" PRId64 " ms", lag);
+
+	wl_list_for_each(output, &notifier->ivi->outputs, link) {
+		if (!output->output || !output->output->enabled)
+			continue;
+
+		/* check them all, to keep their state up to date */
+		if (watchdog_output_stuck(notifier, output, &now) && !reason[0])
+			snprintf(reason, sizeof(reason),
+				 "output %s has not completed a repaint "
+				 "for %" PRId64 " ms", output->name,
+				 timespec_sub_to_msec(&now,
+						      &output->frames.last));
+	}
 
-	wl_event_source_timer_update(notifier->watchdog_source,
-			notifier->watchdog_time);
+	watchdog_arm(notifier);
+
+	if (reason[0]) {
+		weston_log("Withholding the systemd watchdog: %s\n", reason);
+		sd_notifyf(0, "STATUS=Watchdog held: %s", reason);
+		notifier->watchdog_held = true;
+		ivi_loop_stats_leave(notifier->ivi);
+		return 1;
+	}
+
+	if (notifier->watchdog_held) {
+		weston_log("Repaint loop healthy again, resuming the systemd "
+			   "watchdog\n");
+		sd_notify(0, "STATUS=Running");
+		notifier->watchdog_held = false;
+	}
 
 	sd_notify(0, "WATCHDOG=1");
+	ivi_loop_stats_leave(notifier->ivi);
 
 	return 1;
 }
 
+static void
+notifier_send_ready(struct systemd_notifier *notifier, const char *reason)
+{
+	char summary[512];
+
+	if (notifier->ready_timeout_source) {
+		wl_event_source_remove(notifier->ready_timeout_source);
+		notifier->ready_timeout_source = NULL;
+		wl_list_remove(&notifier->first_frame_listener.link);
+	}
+
+	ivi_startup_summary(notifier->ivi, summary, sizeof(summary));
+
+	weston_log("Sending ready to systemd, %s\n", reason);
+	sd_notifyf(0, "READY=1\nSTATUS=%s: %s", reason, summary);
+}
+
+static void
+first_frame_handler(struct wl_listener *listener, void *data)
+{
+	struct systemd_notifier *notifier =
+		container_of(listener, struct systemd_notifier,
+			     first_frame_listener);
+
+	notifier_send_ready(notifier, "first frame shown");
+}
+
+static int
+ready_timeout_handler(void *data)
+{
+	struct systemd_notifier *notifier = data;
+
+	ivi_loop_stats_enter(notifier->ivi, IVI_LOOP_SOURCE_TIMER);
+	notifier_send_ready(notifier, "timed out waiting for the first frame");
+	ivi_loop_stats_leave(notifier->ivi);
+
+	return 0;
+}
+
 static void
 weston_compositor_destroy_listener(struct wl_listener *listener, void *data)
 {
@@ -135,6 +282,11 @@ weston_compositor_destroy_listener(struct wl_listener *listener, void *data)
 	if (notifier->watchdog_source)
 		wl_event_source_remove(notifier->watchdog_source);
 
+	if (notifier->ready_timeout_source) {
+		wl_event_source_remove(notifier->ready_timeout_source);
+		wl_list_remove(&notifier->first_frame_listener.link);
+	}
+
 	wl_list_remove(&notifier->compositor_destroy_listener.link);
 	free(notifier);
 }
@@ -143,9 +295,13 @@ int
 ivi_agl_systemd_notify(struct ivi_compositor *ivi)
 {
 	struct weston_compositor *compositor = ivi->compositor;
+	struct weston_config_section *section;
 	char *watchdog_time_env;
+	char *notify_ready;
 	struct wl_event_loop *loop;
 	int32_t watchdog_time_conv;
+	int32_t ready_timeout;
+	bool wait_first_frame = false;
 
 	struct systemd_notifier *notifier;
 
@@ -153,6 +309,9 @@ ivi_agl_systemd_notify(struct ivi_compositor *ivi)
 	if (notifier == NULL)
 		return -1;
 
+	notifier->ivi = ivi;
+	loop = wl_display_get_event_loop(compositor->wl_display);
+
 	notifier->compositor_destroy_listener.notify =
 		weston_compositor_destroy_listener;
 	wl_signal_add(&compositor->destroy_signal,
@@ -161,9 +320,40 @@ ivi_agl_systemd_notify(struct ivi_compositor *ivi)
 	if (add_systemd_sockets(compositor) < 0)
 		return -1;
 
-	weston_log("Sending ready to systemd\n");
-
-	sd_notify(0, "READY=1");
+	section = weston_config_get_section(ivi->config, "core", NULL, NULL);
+	weston_config_section_get_string(section, "notify-ready",
+					 &notify_ready, "immediate");
+	if (strcmp(notify_ready, "first-frame") == 0)
+		wait_first_frame = true;
+	else if (strcmp(notify_ready, "immediate") != 0)
+		weston_log("Unknown notify-ready '%s', using 'immediate'\n",
+			   notify_ready);
+	free(notify_ready);
+
+	weston_config_section_get_int(section, "notify-ready-timeout",
+				      &ready_timeout,
+				      NOTIFY_READY_TIMEOUT_DEFAULT);
+
+	if (wait_first_frame && !ivi->first_frame_done)
+		notifier->ready_timeout_source =
+			wl_event_loop_add_timer(loop, ready_timeout_handler,
+						notifier);
+
+	if (!notifier->ready_timeout_source) {
+		notifier_send_ready(notifier, "shell clients launched");
+	} else {
+		notifier->first_frame_listener.notify = first_frame_handler;
+		wl_signal_add(&ivi->first_frame_signal,
+			      &notifier->first_frame_listener);
+
+		wl_event_source_timer_update(notifier->ready_timeout_source,
+					     ready_timeout > 0 ? ready_timeout :
+					     NOTIFY_READY_TIMEOUT_DEFAULT);
+
+		weston_log("Waiting for the first frame before sending ready "
+			   "to systemd\n");
+		sd_notify(0, "STATUS=Waiting for the shell client");
+	}
 
 	/* 'WATCHDOG_USEC' is environment variable that is set
 	 * by systemd to transfer 'WatchdogSec' watchdog timeout
@@ -183,11 +373,16 @@ ivi_agl_systemd_notify(struct ivi_compositor *ivi)
 
 	notifier->watchdog_time = watchdog_time_conv;
 
-	loop = wl_display_get_event_loop(compositor->wl_display);
+	weston_config_section_get_int(section, "watchdog-frame-timeout",
+				      &notifier->watchdog_frame_timeout,
+				      WATCHDOG_FRAME_TIMEOUT_DEFAULT);
+	weston_config_section_get_int(section, "watchdog-max-lag",
+				      &notifier->watchdog_max_lag,
+				      WATCHDOG_MAX_LAG_DEFAULT);
+
 	notifier->watchdog_source =
 		wl_event_loop_add_timer(loop, watchdog_handler, notifier);
-	wl_event_source_timer_update(notifier->watchdog_source,
-			notifier->watchdog_time);
+	watchdog_arm(notifier);
 
 	return 0;
 }
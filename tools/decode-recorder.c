@@ -0,0 +1,179 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Prints the events of a flight recorder dump written by agl-compositor,
+ * oldest first, with their time relative to the first one. The dump has to
+ * come from a machine with the same byte order.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shared/flight-recorder.h"
+#include "shared/helpers.h"
+
+static const char * const event_names[] = {
+	[FLIGHT_RECORDER_ACTIVATE] = "activate",
+	[FLIGHT_RECORDER_ACTIVATE_DONE] = "activate-done",
+	[FLIGHT_RECORDER_COMMIT] = "commit",
+	[FLIGHT_RECORDER_LAYER_INSERT] = "layer-insert",
+	[FLIGHT_RECORDER_LAYER_REMOVE] = "layer-remove",
+	[FLIGHT_RECORDER_OUTPUT_ADDED] = "output-added",
+	[FLIGHT_RECORDER_OUTPUT_REMOVED] = "output-removed",
+	[FLIGHT_RECORDER_CLIENT_CREATED] = "client-created",
+	[FLIGHT_RECORDER_CLIENT_DESTROYED] = "client-destroyed",
+	[FLIGHT_RECORDER_REPAINT] = "repaint",
+	[FLIGHT_RECORDER_SHELL_READY] = "shell-ready",
+	[FLIGHT_RECORDER_SIGNAL] = "signal",
+	[FLIGHT_RECORDER_EXIT] = "exit",
+};
+
+/* enum ivi_surface_role */
+static const char * const role_names[] = {
+	"none", "desktop", "background", "panel",
+};
+
+static const char *
+layer_name(uint32_t position)
+{
+	/* enum weston_layer_position */
+	switch (position) {
+	case 0x00000100: return "hidden";
+	case 0x00000002: return "background";
+	case 0x50000000: return "normal";
+	case 0x80000000: return "panel";
+	case 0xb0000000: return "fullscreen";
+	default: return "?";
+	}
+}
+
+static void
+print_record(const struct flight_recorder_record *record, uint64_t start)
+{
+	uint64_t t = record->time - start;
+	char app_id[sizeof(record->b) + 1] = { 0 };
+	const char *name = NULL;
+
+	if (record->type < ARRAY_LENGTH(event_names))
+		name = event_names[record->type];
+
+	printf("%6" PRIu64 ".%06" PRIu64 " %-16s ", t / 1000000000,
+	       (t % 1000000000) / 1000, name ? name : "unknown");
+
+	switch (record->type) {
+	case FLIGHT_RECORDER_ACTIVATE:
+	case FLIGHT_RECORDER_ACTIVATE_DONE:
+		memcpy(app_id, &record->b, sizeof(record->b));
+		printf("output %u app_id %s\n", record->a, app_id);
+		break;
+	case FLIGHT_RECORDER_COMMIT:
+		printf("%s surface 0x%" PRIx64 "\n",
+		       record->a < ARRAY_LENGTH(role_names) ?
+		       role_names[record->a] : "?", record->b);
+		break;
+	case FLIGHT_RECORDER_LAYER_INSERT:
+	case FLIGHT_RECORDER_LAYER_REMOVE:
+		printf("%s view 0x%" PRIx64 "\n", layer_name(record->a),
+		       record->b);
+		break;
+	case FLIGHT_RECORDER_OUTPUT_ADDED:
+	case FLIGHT_RECORDER_OUTPUT_REMOVED:
+		printf("output %u\n", record->a);
+		break;
+	case FLIGHT_RECORDER_CLIENT_CREATED:
+	case FLIGHT_RECORDER_CLIENT_DESTROYED:
+		printf("pid %u client 0x%" PRIx64 "\n", record->a, record->b);
+		break;
+	case FLIGHT_RECORDER_REPAINT:
+		printf("output %u damage %" PRIu64 " pixels\n",
+		       record->a, record->b);
+		break;
+	case FLIGHT_RECORDER_SIGNAL:
+		printf("signal %u address 0x%" PRIx64 "\n",
+		       record->a, record->b);
+		break;
+	default:
+		printf("%u 0x%" PRIx64 "\n", record->a, record->b);
+		break;
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct flight_recorder_header header;
+	struct flight_recorder_record *records;
+	uint64_t first, count;
+	FILE *file;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s FILE\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	file = fopen(argv[1], "rb");
+	if (!file) {
+		perror(argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	if (fread(&header, sizeof(header), 1, file) != 1 ||
+	    memcmp(header.magic, FLIGHT_RECORDER_MAGIC, sizeof(header.magic)) ||
+	    header.version != FLIGHT_RECORDER_VERSION ||
+	    header.record_size != sizeof(*records) ||
+	    header.capacity == 0) {
+		fprintf(stderr, "%s: not a flight recorder dump\n", argv[1]);
+		fclose(file);
+		return EXIT_FAILURE;
+	}
+
+	records = calloc(header.capacity, sizeof(*records));
+	if (!records ||
+	    fread(records, sizeof(*records), header.capacity, file) !=
+	    header.capacity) {
+		fprintf(stderr, "%s: truncated dump\n", argv[1]);
+		free(records);
+		fclose(file);
+		return EXIT_FAILURE;
+	}
+	fclose(file);
+
+	count = header.next < header.capacity ? header.next : header.capacity;
+	first = header.next - count;
+
+	printf("%" PRIu64 " events recorded, showing the last %" PRIu64 "\n",
+	       header.next, count);
+
+	for (uint64_t i = first; i < header.next; i++)
+		print_record(&records[i % header.capacity],
+			     records[first % header.capacity].time);
+
+	free(records);
+
+	return EXIT_SUCCESS;
+}
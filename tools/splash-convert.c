@@ -0,0 +1,156 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Converts a PNG image into the raw format of shared/splash.h, for 'splash'
+ * in [output], so that the compositor doesn't decode images while starting
+ * up. Opaque images become XRGB8888, the others premultiplied ARGB8888. The
+ * output only suits machines with the byte order of the one it ran on.
+ */
+
+#include <png.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shared/splash.h"
+
+/* 0xAARRGGBB in host byte order */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define PNG_FORMAT_HOST_ARGB PNG_FORMAT_BGRA
+#else
+#define PNG_FORMAT_HOST_ARGB PNG_FORMAT_ARGB
+#endif
+
+static uint32_t
+premultiply(uint32_t pixel)
+{
+	uint32_t a = pixel >> 24;
+	uint32_t r = (pixel >> 16) & 0xff;
+	uint32_t g = (pixel >> 8) & 0xff;
+	uint32_t b = pixel & 0xff;
+
+	r = (r * a + 127) / 255;
+	g = (g * a + 127) / 255;
+	b = (b * a + 127) / 255;
+
+	return a << 24 | r << 16 | g << 8 | b;
+}
+
+static bool
+write_splash(const char *path, const struct splash_header *header,
+	     const uint32_t *pixels)
+{
+	FILE *file;
+	bool ok;
+
+	file = fopen(path, "wb");
+	if (!file) {
+		perror(path);
+		return false;
+	}
+
+	ok = fwrite(header, sizeof(*header), 1, file) == 1 &&
+	     fwrite(pixels, header->stride, header->height, file) ==
+	     header->height;
+	if (fclose(file) != 0)
+		ok = false;
+
+	if (!ok) {
+		perror(path);
+		remove(path);
+	}
+
+	return ok;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct splash_header header;
+	png_image png;
+	uint32_t *pixels;
+	size_t count;
+	bool opaque;
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s IMAGE.png OUTPUT\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	memset(&png, 0, sizeof(png));
+	png.version = PNG_IMAGE_VERSION;
+	if (!png_image_begin_read_from_file(&png, argv[1])) {
+		fprintf(stderr, "%s: %s\n", argv[1], png.message);
+		return EXIT_FAILURE;
+	}
+
+	/* the compositor takes nothing larger */
+	if (png.width > INT32_MAX / 4) {
+		fprintf(stderr, "%s: image too wide\n", argv[1]);
+		png_image_free(&png);
+		return EXIT_FAILURE;
+	}
+
+	opaque = !(png.format & PNG_FORMAT_FLAG_ALPHA);
+	png.format = PNG_FORMAT_HOST_ARGB;
+
+	count = (size_t) png.width * png.height;
+	pixels = calloc(count, sizeof(*pixels));
+	if (!pixels) {
+		fprintf(stderr, "%s: out of memory\n", argv[1]);
+		png_image_free(&png);
+		return EXIT_FAILURE;
+	}
+
+	/* frees what libpng holds on to, on failure too */
+	if (!png_image_finish_read(&png, NULL, pixels, 0, NULL)) {
+		fprintf(stderr, "%s: %s\n", argv[1], png.message);
+		free(pixels);
+		return EXIT_FAILURE;
+	}
+
+	if (!opaque)
+		for (size_t i = 0; i < count; i++)
+			pixels[i] = premultiply(pixels[i]);
+
+	memcpy(header.magic, SPLASH_MAGIC, sizeof(header.magic));
+	header.width = png.width;
+	header.height = png.height;
+	header.stride = png.width * 4;
+	header.format = opaque ? SPLASH_FORMAT_XRGB8888 :
+				 SPLASH_FORMAT_ARGB8888;
+
+	if (!write_splash(argv[2], &header, pixels)) {
+		free(pixels);
+		return EXIT_FAILURE;
+	}
+
+	free(pixels);
+
+	return EXIT_SUCCESS;
+}